@@ -1,36 +1,20 @@
 #include <exception>
 
 #include "DNSPacket.h"
+#include "DNSPacketView.h"
 #include "dns_format.h"
 
 DNSPacket::DNSPacket() : header(HEADER_SIZE) {
 }
 
-DNSPacket::DNSPacket(const std::vector<u8> &rawPacket, std::size_t bytesToRead) : DNSPacket() {
-    auto it = rawPacket.begin();
-    for (unsigned i = 0; i < HEADER_SIZE; i++) {
-        header[i] = bitops::getU8(it, rawPacket.end());
-    }
-
-    unsigned questionsCount = getQDCount();
-    for (unsigned i = 0; i < questionsCount; i++) {
-        addQuestion(dns_format::getQuestion(rawPacket.begin(), it, rawPacket.end()));
-    }
-
-    unsigned answersCount = getANCount();
-    for (unsigned i = 0; i < answersCount; i++) {
-        addAnswer(dns_format::getResourceRecord(rawPacket.begin(), it, rawPacket.end()));
-    }
-
-    unsigned unsupportedCount = getARCount() + getNSCount();
-    for (unsigned i = 0; i < unsupportedCount; i++) {
-        // don't want this
-        (void)dns_format::getResourceRecord(rawPacket.begin(), it, rawPacket.end());
-    }
-
-    if (it - rawPacket.begin() != (long)bytesToRead) {
-        throw UnknownFormatException();
-    }
+DNSPacket::DNSPacket(const DNSPacketView &view)
+    : header(view.data, view.data + HEADER_SIZE) {
+    // counts in copied header already match questions and answers
+    view.forEachQuestion(
+        [this](const DNSPacketView::Question &q) { questions.push_back(q.toQuestion()); });
+    view.forEachAnswer([this](const DNSPacketView::ResourceRecord &rr) {
+        answers.push_back(rr.toResourceRecord());
+    });
 }
 
 u16 DNSPacket::getID() const {
@@ -281,6 +265,27 @@ void DNSPacket::ResourceRecord::setAAnswer(u32 address) {
     bitops::addTo(rdata, address);
 }
 
+void DNSPacket::ResourceRecord::setSRVAnswer(u16 priority, u16 weight, u16 port,
+                                             const std::vector<u8> &target) {
+    rrtype = DNSType::SRV;
+    rdata.clear();
+    bitops::addTo(rdata, priority);
+    bitops::addTo(rdata, weight);
+    bitops::addTo(rdata, port);
+    rdata.insert(rdata.end(), target.begin(), target.end());
+    rdlength = rdata.size();
+}
+
+void DNSPacket::ResourceRecord::setTXTAnswer(std::vector<u8> strings) {
+    rrtype = DNSType::TXT;
+    if (strings.empty()) {
+        // at least one, possibly empty, string is required
+        strings.push_back(0);
+    }
+    rdata = std::move(strings);
+    rdlength = rdata.size();
+}
+
 std::vector<u8> DNSPacket::ResourceRecord::generateNetworkFormat() const {
     std::vector<u8> res = name;
     bitops::addTo(res, rrtype);
@@ -307,3 +312,24 @@ std::vector<u8> DNSPacket::ResourceRecord::getPtrAnswer() const {
     }
     return rdata;
 }
+
+u16 DNSPacket::ResourceRecord::getSRVPort() const {
+    if (rrtype != DNSType::SRV) {
+        throw std::logic_error("rrtype != SRV");
+    }
+    return bitops::merge(rdata[4], rdata[5]);
+}
+
+std::vector<u8> DNSPacket::ResourceRecord::getSRVTarget() const {
+    if (rrtype != DNSType::SRV) {
+        throw std::logic_error("rrtype != SRV");
+    }
+    return std::vector<u8>(rdata.begin() + 6, rdata.end());
+}
+
+std::vector<u8> DNSPacket::ResourceRecord::getTXTAnswer() const {
+    if (rrtype != DNSType::TXT) {
+        throw std::logic_error("rrtype != TXT");
+    }
+    return rdata;
+}
@@ -7,16 +7,19 @@
 
 #include "bitops.h"
 
+class DNSPacketView;
+
 class DNSPacket {
 public:
     struct Question;
     struct ResourceRecord;
-    enum DNSType : u16 { UNSUPPORTED = 0, A = 1, PTR = 12, ALL = 255 };
+    enum DNSType : u16 { UNSUPPORTED = 0, A = 1, PTR = 12, TXT = 16, SRV = 33, ALL = 255 };
     enum DNSClass : u16 { IN = 1 };
     enum DNSQR : bool { RESPONSE = true, QUESTION = false };
 
     DNSPacket();
-    DNSPacket(const std::vector<u8> &rawPacket, std::size_t bytesToRead);
+    // view has to be valid
+    explicit DNSPacket(const DNSPacketView &view);
 
     u16 getID() const;
     bool getQR() const;
@@ -71,6 +74,10 @@ public:
         u16 getRRType() const;
         void setPTRAnswer(std::vector<u8> domain);
         void setAAnswer(u32 address);
+        // target - uncompressed domain
+        void setSRVAnswer(u16 priority, u16 weight, u16 port, const std::vector<u8> &target);
+        // strings - sequence of length-prefixed strings, as in rdata
+        void setTXTAnswer(std::vector<u8> strings);
         std::vector<u8> generateNetworkFormat() const;
 
         // returns ipv4 only if rrtype equals A
@@ -79,6 +86,13 @@ public:
         // returns ptr answer only if rrtype equals PTR
         std::vector<u8> getPtrAnswer() const;
 
+        // return parts of srv answer only if rrtype equals SRV
+        u16 getSRVPort() const;
+        std::vector<u8> getSRVTarget() const;
+
+        // returns txt strings only if rrtype equals TXT
+        std::vector<u8> getTXTAnswer() const;
+
     private:
         u16 rrtype;
         u16 rdlength;
@@ -0,0 +1,287 @@
+#include <cctype>
+
+#include "DNSPacketView.h"
+#include "dns_format.h"
+
+DNSPacketView::DNSPacketView(const u8 *data, std::size_t size)
+    : data(data), size(size), valid(false), answersOffset(0) {
+    valid = validate();
+}
+
+bool DNSPacketView::isValid() const {
+    return valid;
+}
+
+u16 DNSPacketView::getID() const {
+    return readU16(data, 0);
+}
+
+bool DNSPacketView::getQR() const {
+    return data[2] & (1 << 7);
+}
+
+u8 DNSPacketView::getOpcode() const {
+    return (data[2] >> 3) & 0x0F;
+}
+
+bool DNSPacketView::getTC() const {
+    return data[2] & (1 << 1);
+}
+
+u8 DNSPacketView::getRCode() const {
+    return data[3] & 0x0F;
+}
+
+u16 DNSPacketView::getQDCount() const {
+    return readU16(data, 4);
+}
+
+u16 DNSPacketView::getANCount() const {
+    return readU16(data, 6);
+}
+
+bool DNSPacketView::validate() {
+    // offsets are kept in u16
+    if (size < HEADER_SIZE || size > 0xFFFF) {
+        return false;
+    }
+
+    std::size_t pos = HEADER_SIZE;
+    for (unsigned i = 0; i < getQDCount(); i++) {
+        if (!checkName(pos) || pos + 4 > size) {
+            return false;
+        }
+        pos += 4;
+    }
+
+    answersOffset = pos;
+    // authority and additional records are validated, but not exposed
+    unsigned recordsCount = getANCount() + readU16(data, 8) + readU16(data, 10);
+    for (unsigned i = 0; i < recordsCount; i++) {
+        if (!checkResourceRecord(pos)) {
+            return false;
+        }
+    }
+
+    return pos == size;
+}
+
+bool DNSPacketView::checkName(std::size_t &pos) const {
+    std::size_t cur = pos;
+    unsigned length = 0;
+    bool jumped = false;
+
+    // pointers lead strictly backwards and labels count to length,
+    // so that every loop ends either at root or at MAX_NAME_LENGTH
+    while (cur < size) {
+        u8 octet = data[cur];
+        if (dns_format::isPointer(octet)) {
+            if (cur + 1 >= size) {
+                return false;
+            }
+            std::size_t target = (dns_format::getOffset(octet) << 8) + data[cur + 1];
+            if (target >= cur) {
+                return false;
+            }
+            if (!jumped) {
+                pos = cur + 2;
+                jumped = true;
+            }
+            cur = target;
+        } else if (octet & 0xC0) {
+            // reserved label types
+            return false;
+        } else {
+            length += octet + 1;
+            if (length > MAX_NAME_LENGTH) {
+                return false;
+            }
+            if (octet == 0) {
+                if (!jumped) {
+                    pos = cur + 1;
+                }
+                return true;
+            }
+            cur += octet + 1;
+        }
+    }
+    return false;
+}
+
+bool DNSPacketView::checkResourceRecord(std::size_t &pos) const {
+    std::size_t namePos = pos;
+    if (!checkName(pos) || pos + 10 > size) {
+        return false;
+    }
+    u16 rrtype = readU16(data, pos);
+    u16 rdlength = readU16(data, pos + 8);
+    pos += 10;
+    if (pos + rdlength > size) {
+        return false;
+    }
+
+    std::size_t rdataEnd = pos + rdlength;
+    std::size_t rdataPos = pos;
+    pos = rdataEnd;
+    switch (rrtype) {
+        case DNSPacket::DNSType::A:
+            return rdlength == 4;
+        case DNSPacket::DNSType::PTR: {
+            if (!checkName(rdataPos) || rdataPos != rdataEnd) {
+                return false;
+            }
+            // name has to be [instance].name
+            Name answer(data, rdataEnd - rdlength);
+            return !answer.isRoot() && answer.withoutFirstLabel().equals(Name(data, namePos));
+        }
+        case DNSPacket::DNSType::SRV:
+            rdataPos += 6;
+            return rdataPos < rdataEnd && checkName(rdataPos) && rdataPos == rdataEnd;
+        default:
+            return true;
+    }
+}
+
+u16 DNSPacketView::skipName(const u8 *packet, u16 offset) {
+    while (true) {
+        u8 octet = packet[offset];
+        if (dns_format::isPointer(octet)) {
+            return offset + 2;
+        }
+        offset += octet + 1;
+        if (octet == 0) {
+            return offset;
+        }
+    }
+}
+
+u16 DNSPacketView::readU16(const u8 *packet, std::size_t offset) {
+    return bitops::merge(packet[offset], packet[offset + 1]);
+}
+
+DNSPacketView::Name::Name(const u8 *packet, u16 offset) : packet(packet), offset(offset) {
+}
+
+DNSPacketView::Name DNSPacketView::Name::fromDomain(const std::vector<u8> &domain) {
+    return Name(domain.data(), 0);
+}
+
+u16 DNSPacketView::Name::resolve(u16 offset) const {
+    while (dns_format::isPointer(packet[offset])) {
+        offset = (dns_format::getOffset(packet[offset]) << 8) + packet[offset + 1];
+    }
+    return offset;
+}
+
+bool DNSPacketView::Name::equals(const Name &other) const {
+    u16 a = resolve(offset);
+    u16 b = other.resolve(other.offset);
+    while (true) {
+        u8 length = packet[a];
+        if (length != other.packet[b]) {
+            return false;
+        }
+        for (unsigned i = 1; i <= length; i++) {
+            if (std::tolower(packet[a + i]) != std::tolower(other.packet[b + i])) {
+                return false;
+            }
+        }
+        if (length == 0) {
+            return true;
+        }
+        a = resolve(a + length + 1);
+        b = other.resolve(b + length + 1);
+    }
+}
+
+bool DNSPacketView::Name::equals(const std::vector<u8> &domain) const {
+    return equals(fromDomain(domain));
+}
+
+bool DNSPacketView::Name::isRoot() const {
+    return packet[resolve(offset)] == 0;
+}
+
+DNSPacketView::Name DNSPacketView::Name::withoutFirstLabel() const {
+    u16 first = resolve(offset);
+    return Name(packet, first + packet[first] + 1);
+}
+
+std::vector<u8> DNSPacketView::Name::toDomain() const {
+    std::vector<u8> res;
+    u16 cur = resolve(offset);
+    while (true) {
+        u8 length = packet[cur];
+        res.insert(res.end(), packet + cur, packet + cur + length + 1);
+        if (length == 0) {
+            return res;
+        }
+        cur = resolve(cur + length + 1);
+    }
+}
+
+DNSPacket::Question DNSPacketView::Question::toQuestion() const {
+    DNSPacket::Question q;
+    q.qname = qname.toDomain();
+    q.qtype = qtype;
+    q.qclass = qclass;
+    q.unicastResponseRequested = unicastResponseRequested;
+    return q;
+}
+
+DNSPacketView::ResourceRecord::ResourceRecord(const u8 *packet, u16 offset)
+    : name(packet, offset), packet(packet) {
+    offset = skipName(packet, offset);
+    rrtype = readU16(packet, offset);
+    rrclass = readU16(packet, offset + 2);
+    ttl = bitops::merge(readU16(packet, offset + 4), readU16(packet, offset + 6));
+    rdlength = readU16(packet, offset + 8);
+    rdataOffset = offset + 10;
+}
+
+u32 DNSPacketView::ResourceRecord::getAddress() const {
+    return bitops::merge(readU16(packet, rdataOffset), readU16(packet, rdataOffset + 2));
+}
+
+DNSPacketView::Name DNSPacketView::ResourceRecord::getPTRAnswer() const {
+    return Name(packet, rdataOffset);
+}
+
+u16 DNSPacketView::ResourceRecord::getSRVPort() const {
+    return readU16(packet, rdataOffset + 4);
+}
+
+DNSPacketView::Name DNSPacketView::ResourceRecord::getSRVTarget() const {
+    return Name(packet, rdataOffset + 6);
+}
+
+DNSPacket::ResourceRecord DNSPacketView::ResourceRecord::toResourceRecord() const {
+    DNSPacket::ResourceRecord rr;
+    rr.name = name.toDomain();
+    // don't want top bit
+    rr.rrclass = rrclass & 0x7F;
+    rr.ttl = ttl;
+
+    switch (rrtype) {
+        case DNSPacket::DNSType::A:
+            rr.setAAnswer(getAddress());
+            break;
+        case DNSPacket::DNSType::PTR:
+            rr.setPTRAnswer(getPTRAnswer().toDomain());
+            break;
+        case DNSPacket::DNSType::SRV:
+            rr.setSRVAnswer(readU16(packet, rdataOffset),
+                            readU16(packet, rdataOffset + 2),
+                            getSRVPort(),
+                            getSRVTarget().toDomain());
+            break;
+        case DNSPacket::DNSType::TXT:
+            rr.setTXTAnswer(
+                std::vector<u8>(packet + rdataOffset, packet + rdataOffset + rdlength));
+            break;
+        default:
+            // don't need that
+            break;
+    }
+    return rr;
+}
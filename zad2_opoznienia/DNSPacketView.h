@@ -0,0 +1,144 @@
+#ifndef DNS_PACKET_VIEW__H
+#define DNS_PACKET_VIEW__H
+
+#include <cstddef>
+#include <vector>
+
+#include "DNSPacket.h"
+#include "bitops.h"
+
+// DNS packet validated in place, questions and resource records are views into given buffer.
+// Neither validation nor views allocate, so uninteresting packets are dropped without copying.
+// Malformed packet is reported by isValid() instead of exception for the same reason.
+// Buffer has to outlive view and everything taken from it.
+class DNSPacketView {
+public:
+    // possibly compressed domain name
+    class Name {
+    public:
+        // domain - uncompressed, e.g. from dns_format::stringToDomain
+        static Name fromDomain(const std::vector<u8> &domain);
+
+        // labels are compared case-insensitively
+        bool equals(const Name &other) const;
+        bool equals(const std::vector<u8> &domain) const;
+
+        bool isRoot() const;
+        // name has to have at least one label
+        Name withoutFirstLabel() const;
+
+        // uncompressed, case preserved
+        std::vector<u8> toDomain() const;
+
+    private:
+        friend class DNSPacketView;
+
+        Name(const u8 *packet, u16 offset);
+        // offset of first label, after following pointers
+        u16 resolve(u16 offset) const;
+
+        const u8 *packet;
+        u16 offset;
+    };
+
+    struct Question {
+        Name qname;
+        u16 qtype;
+        u16 qclass;
+        bool unicastResponseRequested;
+
+        DNSPacket::Question toQuestion() const;
+    };
+
+    class ResourceRecord {
+    public:
+        Name name;
+        u16 rrtype;
+        u16 rrclass;
+        u32 ttl;
+        u16 rdlength;
+
+        // valid only if rrtype matches, checked during validation of packet
+        u32 getAddress() const;
+        Name getPTRAnswer() const;
+        u16 getSRVPort() const;
+        Name getSRVTarget() const;
+
+        DNSPacket::ResourceRecord toResourceRecord() const;
+
+    private:
+        friend class DNSPacketView;
+
+        ResourceRecord(const u8 *packet, u16 offset);
+
+        const u8 *packet;
+        u16 rdataOffset;
+    };
+
+    DNSPacketView(const u8 *data, std::size_t size);
+
+    bool isValid() const;
+
+    // header, only if valid
+    u16 getID() const;
+    bool getQR() const;
+    u8 getOpcode() const;
+    bool getTC() const;
+    u8 getRCode() const;
+    u16 getQDCount() const;
+    u16 getANCount() const;
+
+    // f(const Question &), only if valid
+    template <typename F>
+    void forEachQuestion(F f) const;
+
+    // f(const ResourceRecord &), answer section only, only if valid
+    template <typename F>
+    void forEachAnswer(F f) const;
+
+private:
+    friend class DNSPacket;
+
+    static const unsigned HEADER_SIZE = 12;
+    static const unsigned MAX_NAME_LENGTH = 255;
+
+    const u8 *data;
+    std::size_t size;
+    bool valid;
+    u16 answersOffset;
+
+    bool validate();
+    // moves pos past name, which may end with pointer
+    bool checkName(std::size_t &pos) const;
+    bool checkResourceRecord(std::size_t &pos) const;
+    // unchecked, packet has to be valid
+    static u16 skipName(const u8 *packet, u16 offset);
+    static u16 readU16(const u8 *packet, std::size_t offset);
+};
+
+template <typename F>
+void DNSPacketView::forEachQuestion(F f) const {
+    u16 offset = HEADER_SIZE;
+    for (unsigned i = 0; i < getQDCount(); i++) {
+        Question q{Name(data, offset), 0, 0, false};
+        offset = skipName(data, offset);
+        q.qtype = readU16(data, offset);
+        q.qclass = readU16(data, offset + 2);
+        q.unicastResponseRequested = q.qclass & (1 << 15);
+        q.qclass &= 0x7F;
+        offset += 4;
+        f(q);
+    }
+}
+
+template <typename F>
+void DNSPacketView::forEachAnswer(F f) const {
+    u16 offset = answersOffset;
+    for (unsigned i = 0; i < getANCount(); i++) {
+        ResourceRecord rr(data, offset);
+        f(rr);
+        offset = rr.rdataOffset + rr.rdlength;
+    }
+}
+
+#endif
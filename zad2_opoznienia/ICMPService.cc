@@ -1,3 +1,6 @@
+#include <cstring>
+#include <iostream>
+#include <unistd.h>
 #include <boost/bind.hpp>
 
 #include "ICMPService.h"
@@ -5,9 +8,15 @@
 #include "settings.h"
 
 ICMPService::ICMPService(boost::asio::io_service &ioServiceForListening,
-                         LatencyDatabase &latencyDatabse)
-    : curSeqNum(0),
+                         LatencyDatabase &latencyDatabse, bool kernelTimestamps,
+                         SocketType socketType)
+    : identifier(rand()),
+      pending(SEQ_NUMBERS_COUNT, PendingRequest{0, false, std::chrono::steady_clock::time_point()}),
+      oldestSeqNum(0),
+      nextSeqNum(0),
       listening(false),
+      kernelTimestamps(kernelTimestamps),
+      socketType(socketType),
       buffer(BUFFER_SIZE),
       latencyDatabase(latencyDatabse),
       socket(ioServiceForListening) {
@@ -22,7 +31,11 @@ void ICMPService::prepareRequestData() {
 
 void ICMPService::startListening() {
     if (!listening) {
-        socket.open(boost::asio::ip::icmp::v4());
+        openSocket();
+        if (kernelTimestamps && !timestamping::enable(socket.native_handle())) {
+            std::cerr << __func__ << ": " << strerror(errno) << "\n";
+            throw std::runtime_error("unable to enable kernel timestamps");
+        }
         asyncReceive();
         listening = true;
     } else {
@@ -30,42 +43,121 @@ void ICMPService::startListening() {
     }
 }
 
+void ICMPService::openSocket() {
+    if (socketType != SocketType::DATAGRAM) {
+        boost::system::error_code ec;
+        socket.open(boost::asio::ip::icmp::v4(), ec);
+        if (!ec) {
+            socketType = SocketType::RAW;
+            return;
+        }
+        if (socketType == SocketType::RAW) {
+            throw boost::system::system_error(ec);
+        }
+    }
+
+    if (!openDatagramSocket()) {
+        std::cerr << __func__ << ": " << strerror(errno) << "\n";
+        throw std::runtime_error("unable to open ICMP socket");
+    }
+    socketType = SocketType::DATAGRAM;
+}
+
+bool ICMPService::openDatagramSocket() {
+    int fd = ::socket(AF_INET, SOCK_DGRAM, IPPROTO_ICMP);
+    if (fd == -1) {
+        return false;
+    }
+
+    // kernel replaces identifier of sent requests with "port" of socket,
+    // it is chosen on bind and delivers only replies with it
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    socklen_t addrLen = sizeof(addr);
+    if (bind(fd, (sockaddr *)&addr, sizeof(addr)) != 0 ||
+        getsockname(fd, (sockaddr *)&addr, &addrLen) != 0) {
+        close(fd);
+        return false;
+    }
+    identifier = bitops::ntoh((u16)addr.sin_port);
+
+    boost::system::error_code ec;
+    socket.assign(boost::asio::ip::icmp::v4(), fd, ec);
+    if (ec) {
+        close(fd);
+        errno = ec.value();
+        return false;
+    }
+    return true;
+}
+
 void ICMPService::asyncReceive() {
     socketMutex.lock();
-    socket.async_receive_from(boost::asio::buffer(buffer),
-                              senderEndpoint,
-                              boost::bind(&ICMPService::handleMessage,
-                                          this,
-                                          boost::asio::placeholders::error,
-                                          boost::asio::placeholders::bytes_transferred));
+    socket.async_wait(
+        boost::asio::ip::icmp::socket::wait_read,
+        boost::bind(&ICMPService::handleMessages, this, boost::asio::placeholders::error));
     socketMutex.unlock();
 }
 
-void ICMPService::handleMessage(const boost::system::error_code &error, std::size_t bytesToRead) {
+void ICMPService::handleMessages(const boost::system::error_code &error) {
     if (!error) {
-        try {
-            auto curTime = std::chrono::system_clock::now();
-            auto packet = ICMPEchoPacket(buffer, bytesToRead, true);
-            handleICMPMessage(packet, curTime, senderEndpoint.address().to_v4());
-        } catch (UnknownFormatException &) {
+        iovec iov;
+        iov.iov_base = buffer.data();
+        iov.iov_len = buffer.size();
+
+        sockaddr_in peeraddr;
+        msghdr msgInfo;
+        memset(&msgInfo, 0, sizeof(msgInfo));
+        msgInfo.msg_name = &peeraddr;
+        msgInfo.msg_iov = &iov;
+        msgInfo.msg_iovlen = 1;
+        msgInfo.msg_control = controlBuffer;
+
+        while (true) {
+            msgInfo.msg_namelen = sizeof(peeraddr);
+            msgInfo.msg_controllen = sizeof(controlBuffer);
+            ssize_t recLen = recvmsg(socket.native_handle(), &msgInfo, MSG_DONTWAIT);
+            if (recLen == -1) {
+                break;
+            }
+
+            auto curTime = std::chrono::steady_clock::now();
+            if (kernelTimestamps) {
+                timestamping::getReceiveTime(&msgInfo, curTime);
+            }
+            auto senderAddr = bitops::u32ToAddr(bitops::ntoh((u32)peeraddr.sin_addr.s_addr));
+            handleMessage(recLen, senderAddr, curTime);
         }
     }
     asyncReceive();
 }
 
+void ICMPService::handleMessage(std::size_t bytesToRead, boost::asio::ip::address_v4 senderAddr,
+                                std::chrono::steady_clock::time_point receiveTime) {
+    try {
+        // DATAGRAM socket receives ICMP message without IP header
+        auto packet = ICMPEchoPacket(buffer, bytesToRead, socketType == SocketType::RAW);
+        handleICMPMessage(packet, receiveTime, senderAddr);
+    } catch (UnknownFormatException &) {
+    }
+}
+
 void ICMPService::handleICMPMessage(const ICMPEchoPacket &reply,
-                                    std::chrono::system_clock::time_point receiveTime,
+                                    std::chrono::steady_clock::time_point receiveTime,
                                     boost::asio::ip::address_v4 senderAddr) {
-    if (reply.type != ICMPEchoPacket::REPLY || reply.code != 0 || reply.data != requestData) {
+    if (reply.type != ICMPEchoPacket::REPLY || reply.code != 0 || reply.data != requestData ||
+        reply.identifier != identifier) {
         return;
     }
-    HistoryEntry request{bitops::addrToU32(senderAddr), reply.identifier, reply.seqNumber};
 
     historyMutex.lock();
-    if (requestTime.find(request) != requestTime.end()) {
-        LatencyDatabase::latency_t latency = std::chrono::duration_cast<std::chrono::microseconds>(
-            receiveTime - requestTime[request]);
-        requestTime.erase(request);
+    PendingRequest &request = pending[reply.seqNumber];
+    if (request.valid && request.peerAddr == bitops::addrToU32(senderAddr) &&
+        receiveTime >= request.sendTime) {
+        LatencyDatabase::latency_t latency =
+            std::chrono::duration_cast<std::chrono::microseconds>(receiveTime - request.sendTime);
+        request.valid = false;
         historyMutex.unlock();
 
         latencyDatabase.addLatency(LatencyDatabase::ProtocolType::ICMP, senderAddr, latency);
@@ -82,30 +174,54 @@ void ICMPService::measureLatency(const std::vector<boost::asio::ip::address_v4>
     for (auto addr : addrs) {
         sendRequest(addr);
     }
-    curSeqNum++;
-    if (curSeqNum == 0xFFFF) {
-        curSeqNum = 0;
-    }
 }
 
 void ICMPService::refreshHistory() {
     static const auto maxLatency = std::chrono::seconds(MAX_LATENCY_SECS);
-    auto timeNow = std::chrono::system_clock::now();
-    while (!requestHistory.empty() && requestHistory.front().second < timeNow - maxLatency) {
-        if (requestTime.find(requestHistory.front().first) != requestTime.end()) {
-            requestTime.erase(requestHistory.front().first);
+    auto deadline = std::chrono::steady_clock::now() - maxLatency;
+
+    // requests are in order of send time, answered ones are skipped
+    while (oldestSeqNum != nextSeqNum) {
+        const PendingRequest &request = pending[(u16)oldestSeqNum];
+        if (request.valid && request.sendTime >= deadline) {
+            break;
         }
-        requestHistory.pop();
+        dropOldestRequest();
+    }
+}
+
+void ICMPService::dropOldestRequest() {
+    PendingRequest &request = pending[(u16)oldestSeqNum];
+    if (request.valid) {
+        latencyDatabase.addLoss(LatencyDatabase::ProtocolType::ICMP,
+                                bitops::u32ToAddr(request.peerAddr));
+        request.valid = false;
     }
+    oldestSeqNum++;
+}
+
+u16 ICMPService::addPendingRequest(u32 peerAddr, std::chrono::steady_clock::time_point sendTime) {
+    if (nextSeqNum - oldestSeqNum == SEQ_NUMBERS_COUNT) {
+        // every sequence number is in use, the oldest request is given up
+        dropOldestRequest();
+    }
+    u16 seqNumber = nextSeqNum++;
+    pending[seqNumber] = PendingRequest{peerAddr, true, sendTime};
+    return seqNumber;
 }
 
 void ICMPService::sendRequest(const boost::asio::ip::address_v4 &addr) {
     ICMPEchoPacket request;
     request.type = ICMPEchoPacket::ICMPType::REQUEST;
-    request.identifier = rand();
-    request.seqNumber = curSeqNum;
+    request.identifier = identifier;
     request.data = requestData;
 
+    // registered before sending, so that reply can't arrive earlier
+    historyMutex.lock();
+    request.seqNumber =
+        addPendingRequest(bitops::addrToU32(addr), std::chrono::steady_clock::now());
+    historyMutex.unlock();
+
     boost::system::error_code ec;
     socketMutex.lock();
     socket.send_to(boost::asio::buffer(request.generateNetworkFormat()),
@@ -114,19 +230,8 @@ void ICMPService::sendRequest(const boost::asio::ip::address_v4 &addr) {
                    ec);
     socketMutex.unlock();
     if (ec) {
-        return;
+        historyMutex.lock();
+        pending[request.seqNumber].valid = false;
+        historyMutex.unlock();
     }
-
-    auto nowTime = std::chrono::system_clock::now();
-    HistoryEntry historyEntry{bitops::addrToU32(addr), request.identifier, request.seqNumber};
-
-    historyMutex.lock();
-    requestTime[historyEntry] = nowTime;
-    requestHistory.push(std::make_pair(historyEntry, nowTime));
-    historyMutex.unlock();
-}
-
-bool ICMPService::HistoryEntry::operator<(const HistoryEntry &that) const {
-    return std::make_pair(std::make_pair(peerAddr, identifier), seqNumber) <
-           std::make_pair(std::make_pair(that.peerAddr, that.identifier), that.seqNumber);
 }
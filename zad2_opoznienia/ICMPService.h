@@ -2,15 +2,24 @@
 #define ICMP_SERVICE__H
 
 #include <thread>
-#include <queue>
-#include <map>
+#include <vector>
 
 #include "ICMPEchoPacket.h"
 #include "LatencyDatabase.h"
+#include "timestamping.h"
 
 class ICMPService {
 public:
-    ICMPService(boost::asio::io_service &ioServiceForListening, LatencyDatabase &latencyDatabase);
+    // RAW - receives all ICMP traffic of host, requires CAP_NET_RAW
+    // DATAGRAM - Linux ping socket (SOCK_DGRAM, IPPROTO_ICMP), kernel delivers only replies
+    //     with our identifier, available to groups from net.ipv4.ping_group_range
+    // RAW_OR_DATAGRAM - RAW if permitted, DATAGRAM otherwise
+    enum class SocketType { RAW, DATAGRAM, RAW_OR_DATAGRAM };
+
+    // kernelTimestamps - take receive times of replies from kernel (SO_TIMESTAMPING)
+    ICMPService(boost::asio::io_service &ioServiceForListening, LatencyDatabase &latencyDatabase,
+                bool kernelTimestamps = false,
+                SocketType socketType = SocketType::RAW_OR_DATAGRAM);
     ICMPService() = default;
     ICMPService(const ICMPService &) = delete;
     ICMPService(ICMPService &&) = delete;
@@ -18,40 +27,58 @@ public:
     ICMPService &operator=(ICMPService &&) = delete;
 
     // receive asynchronously, handlers on ioServiceForListening threads
+    // there is at most one pending receive, so handlers never run concurrently
     void startListening();
 
     // send requests synchronously on caller thread
     void measureLatency(const std::vector<boost::asio::ip::address_v4> &addrs);
 
 private:
-    struct HistoryEntry {
-        u32 peerAddr;
-        u16 identifier;
-        u16 seqNumber;
+    // all requests carry the same identifier, sequence numbers are global
+    static const unsigned SEQ_NUMBERS_COUNT = 1 << 16;
 
-        bool operator<(const HistoryEntry &that) const;
+    struct PendingRequest {
+        u32 peerAddr;
+        bool valid;
+        std::chrono::steady_clock::time_point sendTime;
     };
-    u16 curSeqNum;
+
+    u16 identifier;
     u32 requestData;
-    std::queue<std::pair<HistoryEntry, std::chrono::system_clock::time_point>> requestHistory;
-    std::map<HistoryEntry, std::chrono::system_clock::time_point> requestTime;
+
+    // guarded by historyMutex
+    // request with sequence number s is kept at pending[s], so replies are matched in O(1)
+    // requests in [oldestSeqNum; nextSeqNum) may be pending, counters wrap at 2^32,
+    // sequence numbers are their lower 16 bits
+    std::vector<PendingRequest> pending;
+    u32 oldestSeqNum;
+    u32 nextSeqNum;
     std::mutex historyMutex;
 
     bool listening;
+    bool kernelTimestamps;
+    SocketType socketType;
     std::vector<u8> buffer;
+    char controlBuffer[timestamping::CONTROL_BUFFER_SIZE];
     LatencyDatabase &latencyDatabase;
 
     std::mutex socketMutex;
     boost::asio::ip::icmp::socket socket;
-    boost::asio::ip::icmp::endpoint senderEndpoint;
 
+    void openSocket();
+    bool openDatagramSocket();
     void asyncReceive();
 
-    void handleMessage(const boost::system::error_code &error, std::size_t bytesToRead);
+    void handleMessages(const boost::system::error_code &error);
+    void handleMessage(std::size_t bytesToRead, boost::asio::ip::address_v4 senderAddr,
+                       std::chrono::steady_clock::time_point receiveTime);
     void handleICMPMessage(const ICMPEchoPacket &packet,
-                           std::chrono::system_clock::time_point receiveTime,
+                           std::chrono::steady_clock::time_point receiveTime,
                            boost::asio::ip::address_v4 senderAddr);
     void sendRequest(const boost::asio::ip::address_v4 &addr);
+    // historyMutex has to be locked
+    u16 addPendingRequest(u32 peerAddr, std::chrono::steady_clock::time_point sendTime);
+    void dropOldestRequest();
     void refreshHistory();
     void prepareRequestData();
 };
@@ -0,0 +1,208 @@
+#include <cstring>
+#include <iostream>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <sys/socket.h>
+#include <boost/bind.hpp>
+
+#include "InterfaceAddressTable.h"
+#include "settings.h"
+
+InterfaceAddressTable::InterfaceAddressTable(boost::asio::io_service &ioService)
+    : started(false), socket(ioService), buffer(BUFFER_SIZE), prefixLengths(0) {
+}
+
+void InterfaceAddressTable::start() {
+    if (started) {
+        throw std::logic_error("already running");
+    }
+
+    int fd = ::socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+    if (fd == -1) {
+        std::cerr << __func__ << ": " << strerror(errno) << "\n";
+        throw std::runtime_error("unable to open netlink socket");
+    }
+    socket.assign(fd);
+
+    // subscribed before dump, so that no change is missed
+    sockaddr_nl local;
+    memset(&local, 0, sizeof(local));
+    local.nl_family = AF_NETLINK;
+    local.nl_groups = RTMGRP_IPV4_IFADDR;
+    if (bind(fd, (sockaddr *)&local, sizeof(local)) == -1) {
+        std::cerr << __func__ << ": " << strerror(errno) << "\n";
+        throw std::runtime_error("unable to bind netlink socket");
+    }
+
+    requestDump();
+    while (receiveMessages(0)) {
+    }
+    started = true;
+    asyncReceive();
+}
+
+void InterfaceAddressTable::setOnChange(std::function<void()> onChange) {
+    this->onChange = onChange;
+}
+
+u32 InterfaceAddressTable::getLocalAddr(u32 peer) const {
+    std::lock_guard<std::mutex> lock(mutex);
+    for (u64 lengths = prefixLengths; lengths; lengths &= lengths - 1) {
+        unsigned prefixLength = 32 - __builtin_ctzll(lengths);
+        const auto &subnet = subnets[prefixLength];
+        auto it = subnet.find(peer & netmask(prefixLength));
+        if (it != subnet.end()) {
+            return it->second;
+        }
+    }
+    return 0;
+}
+
+void InterfaceAddressTable::requestDump() {
+    struct {
+        nlmsghdr header;
+        ifaddrmsg message;
+    } request;
+    memset(&request, 0, sizeof(request));
+    request.header.nlmsg_len = NLMSG_LENGTH(sizeof(ifaddrmsg));
+    request.header.nlmsg_type = RTM_GETADDR;
+    request.header.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+    request.message.ifa_family = AF_INET;
+
+    if (::send(socket.native_handle(), &request, request.header.nlmsg_len, 0) == -1) {
+        std::cerr << __func__ << ": " << strerror(errno) << "\n";
+        throw std::runtime_error("unable to dump interface addresses");
+    }
+}
+
+void InterfaceAddressTable::asyncReceive() {
+    socket.async_wait(
+        boost::asio::posix::stream_descriptor::wait_read,
+        boost::bind(&InterfaceAddressTable::handleReceive, this, boost::asio::placeholders::error));
+}
+
+void InterfaceAddressTable::handleReceive(const boost::system::error_code &error) {
+    if (error) {
+        return;
+    }
+    receiveMessages(MSG_DONTWAIT);
+    asyncReceive();
+}
+
+bool InterfaceAddressTable::receiveMessages(int flags) {
+    ssize_t length = recv(socket.native_handle(), buffer.data(), buffer.size(), flags);
+    if (length == -1) {
+        if (errno == ENOBUFS) {
+            // kernel dropped events, table is built again from scratch
+            mutex.lock();
+            entries.clear();
+            rebuildSubnets();
+            mutex.unlock();
+            requestDump();
+            return true;
+        }
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+            std::cerr << __func__ << ": " << strerror(errno) << "\n";
+            return false;
+        }
+        return true;
+    }
+
+    bool changed = false;
+    bool more = true;
+    std::size_t remaining = length;
+    for (auto header = (nlmsghdr *)buffer.data(); NLMSG_OK(header, remaining);
+         header = NLMSG_NEXT(header, remaining)) {
+        if (header->nlmsg_type == NLMSG_DONE || header->nlmsg_type == NLMSG_ERROR) {
+            more = false;
+        } else if (header->nlmsg_type == RTM_NEWADDR || header->nlmsg_type == RTM_DELADDR) {
+            handleMessage(header->nlmsg_type, NLMSG_DATA(header), NLMSG_PAYLOAD(header, 0));
+            changed = true;
+        }
+    }
+
+    if (changed && started && onChange) {
+        onChange();
+    }
+    return more;
+}
+
+void InterfaceAddressTable::handleMessage(u16 type, const void *data, std::size_t length) {
+    if (length < sizeof(ifaddrmsg)) {
+        return;
+    }
+    auto message = (const ifaddrmsg *)data;
+    if (message->ifa_family != AF_INET || message->ifa_prefixlen > 32) {
+        return;
+    }
+
+    // IFA_LOCAL is own address on point-to-point links, where IFA_ADDRESS is the peer
+    const in_addr *local = nullptr;
+    const in_addr *address = nullptr;
+    int attributesLength = length - NLMSG_ALIGN(sizeof(ifaddrmsg));
+    for (auto attribute = IFA_RTA(message); RTA_OK(attribute, attributesLength);
+         attribute = RTA_NEXT(attribute, attributesLength)) {
+        if (RTA_PAYLOAD(attribute) < sizeof(in_addr)) {
+            continue;
+        }
+        if (attribute->rta_type == IFA_LOCAL) {
+            local = (const in_addr *)RTA_DATA(attribute);
+        } else if (attribute->rta_type == IFA_ADDRESS) {
+            address = (const in_addr *)RTA_DATA(attribute);
+        }
+    }
+    if (!local) {
+        local = address;
+    }
+    if (!local) {
+        return;
+    }
+
+    Entry entry{(int)message->ifa_index, bitops::ntoh((u32)local->s_addr), message->ifa_prefixlen};
+    if (type == RTM_NEWADDR) {
+        addEntry(entry);
+    } else {
+        removeEntry(entry);
+    }
+}
+
+void InterfaceAddressTable::addEntry(const Entry &entry) {
+    std::lock_guard<std::mutex> lock(mutex);
+    for (auto &e : entries) {
+        if (e.interfaceIndex == entry.interfaceIndex && e.addr == entry.addr) {
+            e = entry;
+            rebuildSubnets();
+            return;
+        }
+    }
+    entries.push_back(entry);
+    rebuildSubnets();
+}
+
+void InterfaceAddressTable::removeEntry(const Entry &entry) {
+    std::lock_guard<std::mutex> lock(mutex);
+    for (auto it = entries.begin(); it != entries.end(); ++it) {
+        if (it->interfaceIndex == entry.interfaceIndex && it->addr == entry.addr) {
+            entries.erase(it);
+            rebuildSubnets();
+            return;
+        }
+    }
+}
+
+// changes are rare, so whole index is rebuilt
+void InterfaceAddressTable::rebuildSubnets() {
+    for (auto &subnet : subnets) {
+        subnet.clear();
+    }
+    prefixLengths = 0;
+    for (const auto &entry : entries) {
+        // first address of subnet wins, as in order of interfaces
+        subnets[entry.prefixLength].emplace(entry.addr & netmask(entry.prefixLength), entry.addr);
+        prefixLengths |= (u64)1 << (32 - entry.prefixLength);
+    }
+}
+
+u32 InterfaceAddressTable::netmask(u8 prefixLength) {
+    return prefixLength ? ~(u32)0 << (32 - prefixLength) : 0;
+}
@@ -0,0 +1,67 @@
+#ifndef INTERFACE_ADDRESS_TABLE__H
+#define INTERFACE_ADDRESS_TABLE__H
+
+#include <functional>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+#include <boost/asio.hpp>
+
+#include "bitops.h"
+
+// Local IPv4 addresses by subnet, kept up to date by netlink RTM_NEWADDR/RTM_DELADDR events.
+// Lookup probes one hash map per prefix length in use, so it doesn't depend on interfaces count.
+class InterfaceAddressTable {
+public:
+    // events are received on ioService threads
+    InterfaceAddressTable(boost::asio::io_service &ioService);
+    InterfaceAddressTable(const InterfaceAddressTable &) = delete;
+    InterfaceAddressTable(InterfaceAddressTable &&) = delete;
+    InterfaceAddressTable &operator=(const InterfaceAddressTable &) = delete;
+    InterfaceAddressTable &operator=(InterfaceAddressTable &&) = delete;
+
+    // dumps current addresses synchronously, then listens for changes
+    void start();
+
+    // called on ioService thread after addresses changed
+    void setOnChange(std::function<void()> onChange);
+
+    // thread-safe
+    // local address of the most specific subnet containing peer, 0 if there is none
+    u32 getLocalAddr(u32 peer) const;
+
+private:
+    struct Entry {
+        int interfaceIndex;
+        u32 addr;
+        u8 prefixLength;
+    };
+
+    bool started;
+    boost::asio::posix::stream_descriptor socket;
+    std::vector<u8> buffer;
+    std::function<void()> onChange;
+
+    // guarded by mutex
+    std::vector<Entry> entries;
+    // subnet -> local address, by prefix length
+    std::unordered_map<u32, u32> subnets[33];
+    // bit i set if prefix length 32 - i is in use
+    u64 prefixLengths;
+    mutable std::mutex mutex;
+
+    void requestDump();
+    void asyncReceive();
+    void handleReceive(const boost::system::error_code &error);
+    // returns false after end of dump
+    bool receiveMessages(int flags);
+    void handleMessage(u16 type, const void *data, std::size_t length);
+    void addEntry(const Entry &entry);
+    void removeEntry(const Entry &entry);
+    // mutex has to be locked
+    void rebuildSubnets();
+
+    static u32 netmask(u8 prefixLength);
+};
+
+#endif
@@ -0,0 +1,135 @@
+#include <cctype>
+#include <cstring>
+#include <stdexcept>
+
+#include "KnownHostTable.h"
+
+KnownHostTable::KnownHostTable(unsigned capacityBits)
+    : slots(2u << capacityBits),
+      slotsMask((2u << capacityBits) - 1),
+      capacity(1u << capacityBits),
+      count(0) {
+    if (capacityBits >= 31) {
+        throw std::logic_error("capacity too big");
+    }
+}
+
+unsigned KnownHostTable::size() const {
+    return count;
+}
+
+bool KnownHostTable::add(const std::vector<u8> &domain, time_point_t expiration,
+                         time_point_t now) {
+    u8 length = labelLength(domain);
+    const u8 *label = domain.data() + 1;
+    u32 hash = hashLabel(label, length);
+
+    u32 idx = homeIdx(hash);
+    while (slots[idx].used) {
+        Slot &slot = slots[idx];
+        if (slot.hash == hash && slot.length == length &&
+            equalLabels(slot.label, label, length)) {
+            slot.expiration = expiration;
+            return true;
+        }
+        idx = (idx + 1) & slotsMask;
+    }
+
+    if (count == capacity) {
+        // dead hosts make room before live ones are dropped, after that slot has to be found again
+        if (evict(now) == 0) {
+            return false;
+        }
+        for (idx = homeIdx(hash); slots[idx].used; idx = (idx + 1) & slotsMask) {
+        }
+    }
+
+    Slot &slot = slots[idx];
+    memcpy(slot.label, label, length);
+    slot.length = length;
+    slot.used = true;
+    slot.hash = hash;
+    slot.expiration = expiration;
+    count++;
+    return true;
+}
+
+bool KnownHostTable::contains(const std::vector<u8> &domain, time_point_t now) {
+    u8 length = labelLength(domain);
+    const u8 *label = domain.data() + 1;
+    u32 idx = find(label, length, hashLabel(label, length));
+    if (idx == slots.size()) {
+        return false;
+    }
+    if (slots[idx].expiration < now) {
+        removeSlot(idx);
+        return false;
+    }
+    return true;
+}
+
+unsigned KnownHostTable::evict(time_point_t now) {
+    unsigned evicted = 0;
+    for (u32 idx = 0; idx < slots.size(); idx++) {
+        // backward shift may move another expired host into idx
+        while (slots[idx].used && slots[idx].expiration < now) {
+            removeSlot(idx);
+            evicted++;
+        }
+    }
+    return evicted;
+}
+
+u32 KnownHostTable::find(const u8 *label, u8 length, u32 hash) const {
+    for (u32 idx = homeIdx(hash);; idx = (idx + 1) & slotsMask) {
+        const Slot &slot = slots[idx];
+        if (!slot.used) {
+            return slots.size();
+        }
+        if (slot.hash == hash && slot.length == length && equalLabels(slot.label, label, length)) {
+            return idx;
+        }
+    }
+}
+
+void KnownHostTable::removeSlot(u32 idx) {
+    // backward shift deletion, no tombstones
+    u32 hole = idx;
+    for (u32 next = (idx + 1) & slotsMask; slots[next].used; next = (next + 1) & slotsMask) {
+        u32 home = homeIdx(slots[next].hash);
+        // move entry into hole unless its home lies cyclically in (hole; next]
+        if (((next - home) & slotsMask) >= ((next - hole) & slotsMask)) {
+            slots[hole] = slots[next];
+            hole = next;
+        }
+    }
+    slots[hole].used = false;
+    count--;
+}
+
+u8 KnownHostTable::labelLength(const std::vector<u8> &domain) {
+    return domain[0] < MAX_LABEL_LENGTH ? domain[0] : MAX_LABEL_LENGTH;
+}
+
+u32 KnownHostTable::homeIdx(u32 hash) const {
+    return hash & slotsMask;
+}
+
+// FNV-1a of lowercased label
+u32 KnownHostTable::hashLabel(const u8 *label, u8 length) {
+    u32 hash = 2166136261u;
+    for (unsigned i = 0; i < length; i++) {
+        hash ^= (u8)std::tolower(label[i]);
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+bool KnownHostTable::equalLabels(const u8 *a, const u8 *b, u8 length) {
+    for (unsigned i = 0; i < length; i++) {
+        if (std::tolower(a[i]) != std::tolower(b[i])) {
+            return false;
+        }
+    }
+    return true;
+}
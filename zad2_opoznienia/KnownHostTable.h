@@ -0,0 +1,59 @@
+#ifndef KNOWN_HOST_TABLE__H
+#define KNOWN_HOST_TABLE__H
+
+#include <chrono>
+#include <vector>
+
+#include "bitops.h"
+
+// Host names i.e. first labels of instance names, with expiration from TTL.
+// Labels are copied into preallocated slots of open addressing table with linear probing,
+// so lookups hash the label in place and neither lookups nor inserts allocate.
+// Labels are compared case-insensitively. Not thread-safe.
+class KnownHostTable {
+public:
+    using time_point_t = std::chrono::time_point<std::chrono::system_clock>;
+
+    // at most 2^capacityBits hosts are known at the same time
+    KnownHostTable(unsigned capacityBits);
+
+    unsigned size() const;
+
+    // domain - uncompressed, only its first label is used
+    // expiration of known host is updated, new host is dropped if table is full of live hosts
+    // returns false if host was dropped
+    bool add(const std::vector<u8> &domain, time_point_t expiration, time_point_t now);
+
+    // expired host is removed on the way
+    bool contains(const std::vector<u8> &domain, time_point_t now);
+
+    // removes all hosts expired before now, returns their count
+    unsigned evict(time_point_t now);
+
+private:
+    static const unsigned MAX_LABEL_LENGTH = 63;
+
+    struct Slot {
+        u8 label[MAX_LABEL_LENGTH];
+        u8 length;
+        bool used;
+        u32 hash;
+        time_point_t expiration;
+    };
+
+    std::vector<Slot> slots;
+    u32 slotsMask;
+    unsigned capacity;
+    unsigned count;
+
+    // slots.size() if there is no such host
+    u32 find(const u8 *label, u8 length, u32 hash) const;
+    void removeSlot(u32 idx);
+    u32 homeIdx(u32 hash) const;
+
+    static u8 labelLength(const std::vector<u8> &domain);
+    static u32 hashLabel(const u8 *label, u8 length);
+    static bool equalLabels(const u8 *a, const u8 *b, u8 length);
+};
+
+#endif
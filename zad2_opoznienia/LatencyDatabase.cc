@@ -1,112 +1,380 @@
 #include <algorithm>
+#include <cstdlib>
+#include <limits>
 
 #include "LatencyDatabase.h"
 
 const std::vector<LatencyDatabase::ProtocolType> LatencyDatabase::allProtocols = {
     ProtocolType::UDP, ProtocolType::TCP, ProtocolType::ICMP};
 
+LatencyDatabase::LatencyDatabase(std::chrono::seconds latencyWindow, unsigned trainLength)
+    : latencyWindow(latencyWindow),
+      trainLength(std::min(std::max(trainLength, 1u), (unsigned)MAX_TRAIN_LENGTH)),
+      version(0),
+      startTime(std::chrono::steady_clock::now()),
+      now(0) {
+}
+
+LatencyDatabase::Shard &LatencyDatabase::getShard(addr_t addr) {
+    // multiplicative hashing, neighbouring addresses land in different shards
+    u32 hash = bitops::addrToU32(addr) * 2654435761u;
+    return shards[hash >> (32 - SHARDS_BITS)];
+}
+
 void LatencyDatabase::setConnectionAvailable(LatencyDatabase::ProtocolType protocol, addr_t addr,
-                                             std::chrono::seconds ttl) {
-    std::unique_lock<std::mutex>(dataMutex);
-    auto &host = data[addr];
+                                             std::chrono::seconds ttl, u16 port) {
+    tick_t timeNow = now.load(std::memory_order_relaxed);
+    tick_t expiration =
+        (tick_t)std::min((u64)timeNow + std::max(ttl.count(), (std::chrono::seconds::rep)0),
+                         (u64)std::numeric_limits<tick_t>::max() - 1);
 
-    host.updateExpired();
-    if (!host.isAnyProtocolAvailable()) {
-        host = Host();
-    }
+    auto &shard = getShard(addr);
+    {
+        std::unique_lock<std::mutex> lock(shard.mutex);
+        auto &host = shard.hosts[addr];
 
-    if (protocol == ProtocolType::TCP) {
-        host.setTCPExpiration(std::chrono::system_clock::now() + ttl);
-    }
-    if (protocol == ProtocolType::UDP) {
-        host.setUDPExpiration(std::chrono::system_clock::now() + ttl);
+        if (!host.isAnyProtocolAvailable()) {
+            host = Host(latencyWindow, trainLength);
+        }
+
+        if (protocol == ProtocolType::TCP) {
+            host.setTCPExpiration(expiration, timeNow);
+            host.tcpPort = port ? port : host.tcpPort;
+        }
+        if (protocol == ProtocolType::UDP) {
+            host.setUDPExpiration(port, expiration, timeNow);
+        }
+        scheduleExpiration(shard, addr, host);
+        shard.version++;
     }
+    version.fetch_add(1, std::memory_order_release);
 }
 
 void LatencyDatabase::addLatency(LatencyDatabase::ProtocolType protocol, addr_t addr,
                                  latency_t ms) {
-    std::unique_lock<std::mutex>(dataMutex);
+    auto &shard = getShard(addr);
+    {
+        std::unique_lock<std::mutex> lock(shard.mutex);
 
-    auto &host = data[addr];
-    host.updateExpired();
-    if (!host.isAnyProtocolAvailable()) {
-        data.erase(addr);
-        return;
+        auto it = shard.hosts.find(addr);
+        if (it == shard.hosts.end() || !it->second.isProtocolAvailable(protocol)) {
+            return;
+        }
+
+        it->second.addLatency(protocol, ms, now.load(std::memory_order_relaxed));
+        scheduleExpiration(shard, addr, it->second);
+        shard.version++;
     }
+    version.fetch_add(1, std::memory_order_release);
+}
 
-    if (!host.isProtocolAvailable(protocol)) {
-        return;
+void LatencyDatabase::addLoss(LatencyDatabase::ProtocolType protocol, addr_t addr, u32 count) {
+    auto &shard = getShard(addr);
+    {
+        std::unique_lock<std::mutex> lock(shard.mutex);
+
+        auto it = shard.hosts.find(addr);
+        if (it == shard.hosts.end() || !it->second.isProtocolAvailable(protocol)) {
+            return;
+        }
+
+        it->second.addLoss(protocol, count, now.load(std::memory_order_relaxed));
+        scheduleExpiration(shard, addr, it->second);
+        shard.version++;
     }
+    version.fetch_add(1, std::memory_order_release);
+}
+
+void LatencyDatabase::beginTrain(addr_t addr) {
+    auto &shard = getShard(addr);
+    {
+        std::unique_lock<std::mutex> lock(shard.mutex);
+
+        auto it = shard.hosts.find(addr);
+        if (it == shard.hosts.end()) {
+            return;
+        }
 
-    host.addLatency(protocol, ms);
+        it->second.beginTrain(now.load(std::memory_order_relaxed));
+        scheduleExpiration(shard, addr, it->second);
+        shard.version++;
+    }
+    version.fetch_add(1, std::memory_order_release);
 }
 
-std::vector<std::pair<LatencyDatabase::addr_t, LatencyDatabase::Host>> LatencyDatabase::getAll() {
-    std::unique_lock<std::mutex>(dataMutex);
+void LatencyDatabase::scheduleExpiration(Shard &shard, addr_t addr, Host &host) {
+    // host is rescheduled when its entry becomes due, so postponed events need no action
+    tick_t event = host.getNextEvent();
+    if (event < host.scheduledEvent) {
+        host.scheduledEvent = shard.expirations.schedule(bitops::addrToU32(addr), event);
+    }
+}
 
-    std::vector<std::pair<addr_t, Host>> res;
-    auto it = data.begin();
-    while (it != data.end()) {
-        it->second.updateExpired();
-        if (!it->second.isAnyProtocolAvailable()) {
-            it = data.erase(it);
-        } else {
-            res.push_back(*it);
-            ++it;
+void LatencyDatabase::updateExpired() {
+    tick_t tick = std::chrono::duration_cast<std::chrono::seconds>(
+                      std::chrono::steady_clock::now() - startTime)
+                      .count();
+    tick_t prevTick = now.load(std::memory_order_relaxed);
+    do {
+        if (prevTick >= tick) {
+            return;
         }
+    } while (!now.compare_exchange_weak(prevTick, tick));
+
+    bool changed = false;
+    for (auto &shard : shards) {
+        std::unique_lock<std::mutex> lock(shard.mutex);
+        shard.expirations.advance(tick, [&](u32 key, tick_t scheduledTick) {
+            auto addr = bitops::u32ToAddr(key);
+            auto it = shard.hosts.find(addr);
+            if (it == shard.hosts.end() || it->second.scheduledEvent != scheduledTick) {
+                // host was removed or scheduled again
+                return;
+            }
+
+            auto &host = it->second;
+            host.update(scheduledTick);
+            if (!host.isAnyProtocolAvailable()) {
+                shard.hosts.erase(it);
+            } else {
+                host.scheduledEvent = std::numeric_limits<tick_t>::max();
+                scheduleExpiration(shard, addr, host);
+            }
+            shard.version++;
+            changed = true;
+        });
     }
-    return res;
+
+    if (changed) {
+        version.fetch_add(1, std::memory_order_release);
+    }
+}
+
+std::shared_ptr<const LatencyDatabase::Snapshot> LatencyDatabase::getSnapshot() {
+    updateExpired();
+
+    auto isUpToDate = [&](const std::shared_ptr<const Snapshot> &snapshot) {
+        return snapshot && snapshot->version == version.load(std::memory_order_acquire);
+    };
+
+    auto snapshot = std::atomic_load(&lastSnapshot);
+    if (isUpToDate(snapshot)) {
+        return snapshot;
+    }
+
+    std::unique_lock<std::mutex> lock(snapshotMutex);
+    snapshot = std::atomic_load(&lastSnapshot);
+    if (isUpToDate(snapshot)) {
+        // rebuilt by another reader in the meantime
+        return snapshot;
+    }
+
+    auto res = std::make_shared<Snapshot>();
+    res->version = version.load(std::memory_order_acquire);
+    for (auto &shard : shards) {
+        refreshShardSnapshot(shard);
+        res->hosts.insert(res->hosts.end(), shard.snapshot.begin(), shard.snapshot.end());
+    }
+
+    snapshot = res;
+    std::atomic_store(&lastSnapshot, snapshot);
+    return snapshot;
+}
+
+void LatencyDatabase::refreshShardSnapshot(Shard &shard) {
+    std::unique_lock<std::mutex> lock(shard.mutex);
+    if (shard.snapshotVersion == shard.version) {
+        return;
+    }
+
+    shard.snapshot.assign(shard.hosts.begin(), shard.hosts.end());
+    shard.snapshotVersion = shard.version;
 }
 
-LatencyDatabase::Host::Host()
-    : tcpExpiration(time_point_t::min()),
-      udpExpiration(time_point_t::min()),
+std::vector<LatencyDatabase::entry_t> LatencyDatabase::getAll() {
+    return getSnapshot()->hosts;
+}
+
+LatencyDatabase::Shard::Shard() : version(0), snapshotVersion(std::numeric_limits<u64>::max()) {
+}
+
+LatencyDatabase::Host::Host(std::chrono::seconds latencyWindow, unsigned trainLength)
+    : tcpExpiration(0),
+      udpExpiration(0),
+      tcpPort(0),
+      udpInstancesCount(0),
+      halfWindow(std::max((tick_t)latencyWindow.count() / 2, (tick_t)1)),
+      windowRotation(0),
+      scheduledEvent(std::numeric_limits<tick_t>::max()),
+      trainLength(trainLength),
       udpExpired(true),
       tcpExpired(true) {
 }
 
-void LatencyDatabase::Host::addLatency(LatencyDatabase::ProtocolType protocol, latency_t ms) {
-    TimeMemory *tMem = getForProtocol(protocol);
+void LatencyDatabase::Host::addLatency(LatencyDatabase::ProtocolType protocol, latency_t ms,
+                                       tick_t now) {
+    rotateWindow(now);
+    getQuality(protocol)->addLatency(ms);
+    if (trainLength == 1) {
+        getForProtocol(protocol)->add(ms);
+        return;
+    }
 
-    tMem->lastIdx = (tMem->lastIdx + 1) % 10;
-    tMem->count = std::min(tMem->count + 1, 10u);
+    auto *train = getTrain(protocol);
+    train->samples[train->count++] = (u32)std::min(ms.count(), (latency_t::rep)UINT32_MAX);
+    if (train->count == trainLength) {
+        commitTrain(protocol);
+    }
+}
 
-    tMem->sum -= tMem->latencies[tMem->lastIdx];
-    tMem->latencies[tMem->lastIdx] = ms;
-    tMem->sum += ms;
+void LatencyDatabase::Host::beginTrain(tick_t now) {
+    rotateWindow(now);
+    for (const auto protocol : LatencyDatabase::allProtocols) {
+        commitTrain(protocol);
+    }
+}
 
-    updateExpired();
+void LatencyDatabase::Host::commitTrain(LatencyDatabase::ProtocolType protocol) {
+    auto *train = getTrain(protocol);
+    if (!train->count) {
+        return;
+    }
+
+    // at most MAX_TRAIN_LENGTH samples, no allocation
+    u32 *begin = train->samples;
+    u32 *end = train->samples + train->count;
+    u32 *median = begin + (train->count - 1) / 2;
+    std::nth_element(begin, median, end);
+    u32 min = *std::min_element(begin, end);
+    u32 max = *std::max_element(begin, end);
+
+    getForProtocol(protocol)->add(latency_t(*median));
+    train->known = true;
+    train->min = latency_t(min);
+    train->dispersion = latency_t(max - min);
+    train->count = 0;
 }
 
-void LatencyDatabase::Host::setTCPExpiration(time_point_t expiration) {
-    tcpExpiration = expiration;
-    updateExpired();
+void LatencyDatabase::Host::addLoss(LatencyDatabase::ProtocolType protocol, u32 count,
+                                    tick_t now) {
+    rotateWindow(now);
+    auto *quality = getQuality(protocol);
+    quality->lost[quality->current] += count;
 }
 
-void LatencyDatabase::Host::setUDPExpiration(time_point_t expiration) {
-    udpExpiration = expiration;
-    updateExpired();
+void LatencyDatabase::Host::setTCPExpiration(tick_t expiration, tick_t now) {
+    tcpExpiration = expiration;
+    update(now);
 }
 
-void LatencyDatabase::Host::updateExpired() {
-    auto timeNow = std::chrono::system_clock::now();
-    udpExpired = false;
-    tcpExpired = false;
+void LatencyDatabase::Host::setUDPExpiration(u16 port, tick_t expiration, tick_t now) {
+    Instance *instance = nullptr;
+    bool portKnown = false;
+    for (unsigned i = 0; i < udpInstancesCount; i++) {
+        if (udpInstances[i].port == port) {
+            instance = &udpInstances[i];
+        }
+        portKnown |= udpInstances[i].port != 0;
+    }
+
+    if (!instance && !(port == 0 && portKnown)) {
+        if (port != 0 && udpInstancesCount == 1 && udpInstances[0].port == 0) {
+            // port of instance is known now
+            instance = &udpInstances[0];
+        } else if (udpInstancesCount < MAX_INSTANCES_PER_HOST) {
+            instance = &udpInstances[udpInstancesCount++];
+        } else {
+            instance = std::min_element(udpInstances,
+                                        udpInstances + udpInstancesCount,
+                                        [](const Instance &a, const Instance &b) {
+                                            return a.expiration < b.expiration;
+                                        });
+        }
+        instance->port = port;
+    }
+    if (instance) {
+        instance->expiration = expiration;
+    }
+
+    udpExpiration = 0;
+    for (unsigned i = 0; i < udpInstancesCount; i++) {
+        udpExpiration = std::max(udpExpiration, udpInstances[i].expiration);
+    }
+    update(now);
+}
 
-    if (timeNow > tcpExpiration) {
-        tcpTime = TimeMemory();
+void LatencyDatabase::Host::update(tick_t now) {
+    if (now > tcpExpiration) {
+        clearProtocol(ProtocolType::TCP);
         tcpExpired = true;
     } else {
         tcpExpired = false;
     }
 
-    if (timeNow > udpExpiration) {
-        udpTime = TimeMemory();
-        icmpTime = TimeMemory();
+    unsigned live = 0;
+    for (unsigned i = 0; i < udpInstancesCount; i++) {
+        if (now <= udpInstances[i].expiration) {
+            udpInstances[live++] = udpInstances[i];
+        }
+    }
+    udpInstancesCount = live;
+
+    if (now > udpExpiration) {
+        clearProtocol(ProtocolType::UDP);
+        clearProtocol(ProtocolType::ICMP);
         udpExpired = true;
     } else {
         udpExpired = false;
     }
+
+    rotateWindow(now);
+}
+
+void LatencyDatabase::Host::rotateWindow(tick_t now) {
+    if (now < windowRotation) {
+        return;
+    }
+
+    // whole window passed since last rotation - nothing to keep
+    bool windowPassed = now >= windowRotation + halfWindow;
+    for (const auto protocol : LatencyDatabase::allProtocols) {
+        if (windowPassed) {
+            clearProtocol(protocol);
+        } else {
+            getForProtocol(protocol)->rotate();
+            getQuality(protocol)->rotate();
+        }
+    }
+    windowRotation = (windowPassed ? now : windowRotation) + halfWindow;
+}
+
+LatencyDatabase::tick_t LatencyDatabase::Host::getNextEvent() const {
+    auto res = std::numeric_limits<tick_t>::max();
+    if (!tcpExpired) {
+        res = std::min(res, tcpExpiration + 1);
+    }
+    for (unsigned i = 0; i < udpInstancesCount; i++) {
+        res = std::min(res, udpInstances[i].expiration + 1);
+    }
+    if (isAnyWindowDataKnown()) {
+        res = std::min(res, windowRotation);
+    }
+    return res;
+}
+
+bool LatencyDatabase::Host::isAnyWindowDataKnown() const {
+    for (const auto protocol : LatencyDatabase::allProtocols) {
+        if (getQualityConst(protocol)->getReceived() || getLostCount(protocol)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void LatencyDatabase::Host::clearProtocol(LatencyDatabase::ProtocolType protocol) {
+    getForProtocol(protocol)->clear();
+    getQuality(protocol)->clear();
+    getTrain(protocol)->clear();
 }
 
 bool LatencyDatabase::Host::isAnyProtocolAvailable() const {
@@ -120,6 +388,18 @@ bool LatencyDatabase::Host::isProtocolAvailable(LatencyDatabase::ProtocolType pr
     return !udpExpired;
 }
 
+u16 LatencyDatabase::Host::getTCPPort() const {
+    return tcpPort;
+}
+
+unsigned LatencyDatabase::Host::getUDPPortsCount() const {
+    return udpInstancesCount;
+}
+
+u16 LatencyDatabase::Host::getUDPPort(unsigned instance) const {
+    return udpInstances[instance].port;
+}
+
 bool LatencyDatabase::Host::isAnyLatencyKnown() const {
     for (const auto protocol : LatencyDatabase::allProtocols) {
         if (isLatencyKnown(protocol)) {
@@ -143,20 +423,69 @@ double LatencyDatabase::Host::getAverageLatency() const {
 }
 
 bool LatencyDatabase::Host::isLatencyKnown(LatencyDatabase::ProtocolType protocol) const {
-    return getForProtocolConst(protocol)->count;
+    return getForProtocolConst(protocol)->getCount();
 }
 
 LatencyDatabase::latency_t LatencyDatabase::Host::getLatency(
     LatencyDatabase::ProtocolType protocol) const {
-    const TimeMemory *tMem = getForProtocolConst(protocol);
-    if (tMem->count) {
-        return tMem->sum / tMem->count;
+    return getLatencyPercentile(protocol, 50);
+}
+
+LatencyDatabase::latency_t LatencyDatabase::Host::getLatencyPercentile(
+    LatencyDatabase::ProtocolType protocol, double percentile) const {
+    const LatencyHistogram *histogram = getForProtocolConst(protocol);
+    if (histogram->getCount()) {
+        return histogram->getPercentile(percentile);
     } else {
         throw std::logic_error("Latency not available/not known");
     }
 }
 
-const LatencyDatabase::Host::TimeMemory *LatencyDatabase::Host::getForProtocolConst(
+u32 LatencyDatabase::Host::getReceivedCount(LatencyDatabase::ProtocolType protocol) const {
+    return getQualityConst(protocol)->getReceived();
+}
+
+u32 LatencyDatabase::Host::getLostCount(LatencyDatabase::ProtocolType protocol) const {
+    return getQualityConst(protocol)->getLost();
+}
+
+double LatencyDatabase::Host::getLossRate(LatencyDatabase::ProtocolType protocol) const {
+    // histogram holds one sample per train, so replies are counted separately
+    u32 lost = getLostCount(protocol);
+    u32 sent = lost + getQualityConst(protocol)->getReceived();
+    return sent ? (double)lost / sent : 0;
+}
+
+LatencyDatabase::latency_t LatencyDatabase::Host::getJitter(
+    LatencyDatabase::ProtocolType protocol) const {
+    return latency_t(getQualityConst(protocol)->scaledJitter >> 4);
+}
+
+bool LatencyDatabase::Host::isTrainKnown(LatencyDatabase::ProtocolType protocol) const {
+    return getTrainConst(protocol)->known;
+}
+
+LatencyDatabase::latency_t LatencyDatabase::Host::getTrainMin(
+    LatencyDatabase::ProtocolType protocol) const {
+    const Train *train = getTrainConst(protocol);
+    if (train->known) {
+        return train->min;
+    } else {
+        throw std::logic_error("Train not known");
+    }
+}
+
+LatencyDatabase::latency_t LatencyDatabase::Host::getTrainDispersion(
+    LatencyDatabase::ProtocolType protocol) const {
+    const Train *train = getTrainConst(protocol);
+    if (train->known) {
+        return train->dispersion;
+    } else {
+        throw std::logic_error("Train not known");
+    }
+}
+
+const LatencyHistogram *LatencyDatabase::Host::getForProtocolConst(
     LatencyDatabase::ProtocolType protocol) const {
     switch (protocol) {
         case ProtocolType::ICMP:
@@ -169,8 +498,7 @@ const LatencyDatabase::Host::TimeMemory *LatencyDatabase::Host::getForProtocolCo
     return nullptr;
 }
 
-LatencyDatabase::Host::TimeMemory *LatencyDatabase::Host::getForProtocol(
-    LatencyDatabase::ProtocolType protocol) {
+LatencyHistogram *LatencyDatabase::Host::getForProtocol(LatencyDatabase::ProtocolType protocol) {
     switch (protocol) {
         case ProtocolType::ICMP:
             return &icmpTime;
@@ -182,8 +510,103 @@ LatencyDatabase::Host::TimeMemory *LatencyDatabase::Host::getForProtocol(
     return nullptr;
 }
 
-LatencyDatabase::Host::TimeMemory::TimeMemory() : lastIdx(0), count(0), sum(0) {
-    for (auto &x : latencies) {
-        x = latency_t(0);
+const LatencyDatabase::Host::Quality *LatencyDatabase::Host::getQualityConst(
+    LatencyDatabase::ProtocolType protocol) const {
+    switch (protocol) {
+        case ProtocolType::ICMP:
+            return &icmpQuality;
+        case ProtocolType::UDP:
+            return &udpQuality;
+        case ProtocolType::TCP:
+            return &tcpQuality;
+    }
+    return nullptr;
+}
+
+LatencyDatabase::Host::Quality *LatencyDatabase::Host::getQuality(
+    LatencyDatabase::ProtocolType protocol) {
+    switch (protocol) {
+        case ProtocolType::ICMP:
+            return &icmpQuality;
+        case ProtocolType::UDP:
+            return &udpQuality;
+        case ProtocolType::TCP:
+            return &tcpQuality;
+    }
+    return nullptr;
+}
+
+LatencyDatabase::Host::Quality::Quality() {
+    clear();
+}
+
+void LatencyDatabase::Host::Quality::addLatency(latency_t latency) {
+    if (lastLatencyKnown) {
+        // J += (|D| - J) / 16, with J kept multiplied by 16
+        u32 diff = std::abs((latency - lastLatency).count());
+        scaledJitter += diff - ((scaledJitter + 8) >> 4);
+    }
+    lastLatency = latency;
+    lastLatencyKnown = true;
+    received[current]++;
+}
+
+void LatencyDatabase::Host::Quality::rotate() {
+    current ^= 1;
+    lost[current] = 0;
+    received[current] = 0;
+}
+
+void LatencyDatabase::Host::Quality::clear() {
+    lost[0] = lost[1] = 0;
+    received[0] = received[1] = 0;
+    current = 0;
+    scaledJitter = 0;
+    lastLatency = latency_t(0);
+    lastLatencyKnown = false;
+}
+
+u32 LatencyDatabase::Host::Quality::getLost() const {
+    return lost[0] + lost[1];
+}
+
+u32 LatencyDatabase::Host::Quality::getReceived() const {
+    return received[0] + received[1];
+}
+
+const LatencyDatabase::Host::Train *LatencyDatabase::Host::getTrainConst(
+    LatencyDatabase::ProtocolType protocol) const {
+    switch (protocol) {
+        case ProtocolType::ICMP:
+            return &icmpTrain;
+        case ProtocolType::UDP:
+            return &udpTrain;
+        case ProtocolType::TCP:
+            return &tcpTrain;
+    }
+    return nullptr;
+}
+
+LatencyDatabase::Host::Train *LatencyDatabase::Host::getTrain(
+    LatencyDatabase::ProtocolType protocol) {
+    switch (protocol) {
+        case ProtocolType::ICMP:
+            return &icmpTrain;
+        case ProtocolType::UDP:
+            return &udpTrain;
+        case ProtocolType::TCP:
+            return &tcpTrain;
     }
+    return nullptr;
+}
+
+LatencyDatabase::Host::Train::Train() {
+    clear();
+}
+
+void LatencyDatabase::Host::Train::clear() {
+    count = 0;
+    known = false;
+    min = latency_t(0);
+    dispersion = latency_t(0);
 }
@@ -1,11 +1,17 @@
 #ifndef LATENCY_DATABASE__H
 #define LATENCY_DATABASE__H
 
+#include <atomic>
 #include <chrono>
+#include <map>
+#include <memory>
 #include <mutex>
 #include <boost/asio.hpp>
 
+#include "LatencyHistogram.h"
+#include "TimingWheel.h"
 #include "bitops.h"
+#include "settings.h"
 
 class LatencyDatabase {
 public:
@@ -16,61 +22,219 @@ public:
     // order: UDP, TCP, ICMP
     static const std::vector<ProtocolType> allProtocols;
 
+    // database clock, seconds since creation of database
+    using tick_t = TimingWheel::tick_t;
+
     class Host {
     public:
-        using time_point_t = std::chrono::time_point<std::chrono::system_clock>;
+        // latencies older than latencyWindow are forgotten
+        // trainLength - samples of one train are committed as their median,
+        //     1 means that every sample is committed
+        Host(std::chrono::seconds latencyWindow = std::chrono::seconds(10),
+             unsigned trainLength = 1);
 
-        Host();
+        // median
         latency_t getLatency(ProtocolType protocol) const;
-        void addLatency(ProtocolType protocol, latency_t ms);
-
-        void setTCPExpiration(time_point_t expiration);
-        void setUDPExpiration(time_point_t expiration);
-
-        void updateExpired();
+        // percentile in [0; 100]
+        latency_t getLatencyPercentile(ProtocolType protocol, double percentile) const;
+        // answered probes within latency window
+        u32 getReceivedCount(ProtocolType protocol) const;
+        void addLatency(ProtocolType protocol, latency_t ms, tick_t now);
+
+        // lost probes within latency window
+        u32 getLostCount(ProtocolType protocol) const;
+        // lost / (lost + received) within latency window, 0 if nothing was sent
+        double getLossRate(ProtocolType protocol) const;
+        // RFC 3550 interarrival jitter of consecutive latencies
+        latency_t getJitter(ProtocolType protocol) const;
+        void addLoss(ProtocolType protocol, u32 count, tick_t now);
+
+        // commits samples of unfinished trains, next samples start new ones
+        void beginTrain(tick_t now);
+        // minimum and max - min of last committed train
+        bool isTrainKnown(ProtocolType protocol) const;
+        latency_t getTrainMin(ProtocolType protocol) const;
+        latency_t getTrainDispersion(ProtocolType protocol) const;
+
+        void setTCPExpiration(tick_t expiration, tick_t now);
+        // instance on port is added or refreshed, UDP is available until the last one expires
+        // if all MAX_INSTANCES_PER_HOST are taken, the one expiring first is replaced
+        // port 0 - not known, such instance is dropped when any port is known
+        void setUDPExpiration(u16 port, tick_t expiration, tick_t now);
+
+        // expires protocols and moves latency window
+        void update(tick_t now);
+
+        // earliest tick at which availability of any protocol or latency window changes
+        tick_t getNextEvent() const;
 
         bool isProtocolAvailable(ProtocolType protocol) const;
         bool isAnyProtocolAvailable() const;
 
+        // advertised port of TCP service, 0 if not known
+        u16 getTCPPort() const;
+        // advertised ports of UDP instances, 0 if not known
+        unsigned getUDPPortsCount() const;
+        u16 getUDPPort(unsigned instance) const;
+
         bool isLatencyKnown(ProtocolType protocol) const;
         bool isAnyLatencyKnown() const;
         double getAverageLatency() const;
 
     private:
-        struct TimeMemory {
-            TimeMemory();
+        friend class LatencyDatabase;
+
+        // updated incrementally with every sample, halves follow histograms
+        struct Quality {
+            u32 lost[2];
+            u32 received[2];
+            unsigned current;
+            // jitter * 16, as in RFC 3550 A.8
+            u32 scaledJitter;
+            latency_t lastLatency;
+            bool lastLatencyKnown;
+
+            Quality();
+            void addLatency(latency_t latency);
+            void rotate();
+            void clear();
+            u32 getLost() const;
+            u32 getReceived() const;
+        };
 
-            unsigned lastIdx;
+        struct Train {
+            // microseconds
+            u32 samples[MAX_TRAIN_LENGTH];
             unsigned count;
-            latency_t latencies[10];
-            latency_t sum;
+            bool known;
+            latency_t min;
+            latency_t dispersion;
+
+            Train();
+            void clear();
         };
 
-        time_point_t tcpExpiration;
-        time_point_t udpExpiration;
-        TimeMemory icmpTime;
-        TimeMemory tcpTime;
-        TimeMemory udpTime;
+        struct Instance {
+            u16 port;
+            tick_t expiration;
+        };
+
+        tick_t tcpExpiration;
+        // the latest of instances expirations
+        tick_t udpExpiration;
+        u16 tcpPort;
+        Instance udpInstances[MAX_INSTANCES_PER_HOST];
+        unsigned udpInstancesCount;
+        // each histogram keeps two halves of window
+        tick_t halfWindow;
+        tick_t windowRotation;
+        // earliest tick at which host is in timing wheel
+        tick_t scheduledEvent;
+        LatencyHistogram icmpTime;
+        LatencyHistogram tcpTime;
+        LatencyHistogram udpTime;
+        Quality icmpQuality;
+        Quality tcpQuality;
+        Quality udpQuality;
+        unsigned trainLength;
+        Train icmpTrain;
+        Train tcpTrain;
+        Train udpTrain;
         bool udpExpired;
         bool tcpExpired;
 
-        TimeMemory *getForProtocol(ProtocolType protocol);
-        const TimeMemory *getForProtocolConst(ProtocolType protocol) const;
+        void rotateWindow(tick_t now);
+        bool isAnyWindowDataKnown() const;
+        void clearProtocol(ProtocolType protocol);
+        LatencyHistogram *getForProtocol(ProtocolType protocol);
+        const LatencyHistogram *getForProtocolConst(ProtocolType protocol) const;
+        Quality *getQuality(ProtocolType protocol);
+        const Quality *getQualityConst(ProtocolType protocol) const;
+        Train *getTrain(ProtocolType protocol);
+        const Train *getTrainConst(ProtocolType protocol) const;
+        void commitTrain(ProtocolType protocol);
     };
 
-    // thread-safe
-    void setConnectionAvailable(ProtocolType ProtocolType, addr_t addr, std::chrono::seconds ttl);
+    using entry_t = std::pair<addr_t, Host>;
 
-    // thread-safe
+    // immutable copy of not expired hosts, shared between readers
+    struct Snapshot {
+        u64 version;
+        std::vector<entry_t> hosts;
+    };
+
+    // trainLength - see Host, at most MAX_TRAIN_LENGTH
+    LatencyDatabase(std::chrono::seconds latencyWindow = std::chrono::seconds(10),
+                    unsigned trainLength = 1);
+    LatencyDatabase(const LatencyDatabase &) = delete;
+    LatencyDatabase(LatencyDatabase &&) = delete;
+    LatencyDatabase &operator=(const LatencyDatabase &) = delete;
+    LatencyDatabase &operator=(LatencyDatabase &&) = delete;
+
+    // thread-safe, locks only shard of addr
+    // port - where service listens, 0 if not known
+    // hosts are identified by address, samples of all UDP instances of host are merged,
+    // TCP service has one port per host
+    void setConnectionAvailable(ProtocolType ProtocolType, addr_t addr, std::chrono::seconds ttl,
+                                u16 port = 0);
+
+    // thread-safe, locks only shard of addr
     void addLatency(ProtocolType type, addr_t addr, latency_t ms);
 
+    // thread-safe, locks only shard of addr
+    // count probes sent to addr were not answered in time
+    void addLoss(ProtocolType type, addr_t addr, u32 count = 1);
+
+    // thread-safe, locks only shard of addr
+    // called before first probe of train sent to addr
+    void beginTrain(addr_t addr);
+
+    // thread-safe
+    // moves database clock to current time and expires hosts
+    // cost depends on number of hosts with expiration due, not on number of all hosts
+    void updateExpired();
+
+    // thread-safe, calls updateExpired()
+    // doesn't take shard locks if nothing changed since last call,
+    // otherwise copies only modified shards
+    std::shared_ptr<const Snapshot> getSnapshot();
+
     // thread-safe
     // returns copy of not expired hosts
-    std::vector<std::pair<addr_t, Host>> getAll();
+    std::vector<entry_t> getAll();
 
 private:
-    std::map<addr_t, Host> data;
-    std::mutex dataMutex;
+    static const unsigned SHARDS_BITS = 4;
+    static const unsigned SHARDS_COUNT = 1 << SHARDS_BITS;
+
+    struct Shard {
+        Shard();
+
+        // guarded by mutex
+        std::map<addr_t, Host> hosts;
+        TimingWheel expirations;
+        u64 version;
+        std::mutex mutex;
+
+        // guarded by snapshotMutex
+        u64 snapshotVersion;
+        std::vector<entry_t> snapshot;
+    };
+
+    std::chrono::seconds latencyWindow;
+    unsigned trainLength;
+    Shard shards[SHARDS_COUNT];
+    std::atomic<u64> version;
+
+    const std::chrono::steady_clock::time_point startTime;
+    std::atomic<tick_t> now;
+
+    std::shared_ptr<const Snapshot> lastSnapshot;
+    std::mutex snapshotMutex;
+
+    Shard &getShard(addr_t addr);
+    void scheduleExpiration(Shard &shard, addr_t addr, Host &host);
+    void refreshShardSnapshot(Shard &shard);
 };
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,82 @@
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include <stdexcept>
+
+#include "LatencyHistogram.h"
+
+LatencyHistogram::LatencyHistogram() : current(0) {
+    clear();
+}
+
+void LatencyHistogram::add(latency_t latency) {
+    u32 value = std::min((u64)std::max(latency.count(), (latency_t::rep)0), (u64)MAX_VALUE);
+    Counts &counts = halves[current];
+
+    u16 &bucket = counts.buckets[bucketIdx(value)];
+    if (bucket == std::numeric_limits<u16>::max() ||
+        counts.total == std::numeric_limits<u16>::max()) {
+        // saturated, window is too long for sampling rate
+        return;
+    }
+    bucket++;
+    counts.total++;
+    counts.max = std::max(counts.max, value);
+}
+
+void LatencyHistogram::rotate() {
+    current ^= 1;
+    memset(&halves[current], 0, sizeof(Counts));
+}
+
+void LatencyHistogram::clear() {
+    memset(halves, 0, sizeof(halves));
+}
+
+u32 LatencyHistogram::getCount() const {
+    return (u32)halves[0].total + halves[1].total;
+}
+
+LatencyHistogram::latency_t LatencyHistogram::getPercentile(double percentile) const {
+    u32 count = getCount();
+    if (!count) {
+        throw std::logic_error("histogram is empty");
+    }
+
+    u32 rank = std::max((u32)std::ceil(percentile / 100.0 * count), (u32)1);
+    u32 seen = 0;
+    for (unsigned i = 0; i < BUCKETS_COUNT; i++) {
+        seen += halves[0].buckets[i] + halves[1].buckets[i];
+        if (seen >= rank) {
+            return latency_t(std::min(bucketValue(i), std::max(halves[0].max, halves[1].max)));
+        }
+    }
+    return getMax();
+}
+
+LatencyHistogram::latency_t LatencyHistogram::getMax() const {
+    if (!getCount()) {
+        throw std::logic_error("histogram is empty");
+    }
+    return latency_t(std::max(halves[0].max, halves[1].max));
+}
+
+unsigned LatencyHistogram::bucketIdx(u32 value) {
+    if (value < SUB_BUCKETS_COUNT) {
+        return value;
+    }
+    unsigned highestBit = 31 - __builtin_clz(value);
+    unsigned shift = highestBit - SUB_BUCKET_BITS;
+    return (shift + 1) * SUB_BUCKETS_COUNT + ((value >> shift) & (SUB_BUCKETS_COUNT - 1));
+}
+
+u32 LatencyHistogram::bucketValue(unsigned idx) {
+    if (idx < SUB_BUCKETS_COUNT) {
+        return idx;
+    }
+    unsigned shift = idx / SUB_BUCKETS_COUNT - 1;
+    u32 lowest = (SUB_BUCKETS_COUNT + idx % SUB_BUCKETS_COUNT) << shift;
+    // middle of bucket
+    return lowest + ((1u << shift) >> 1);
+}
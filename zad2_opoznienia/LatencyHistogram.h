@@ -0,0 +1,54 @@
+#ifndef LATENCY_HISTOGRAM__H
+#define LATENCY_HISTOGRAM__H
+
+#include <chrono>
+
+#include "bitops.h"
+
+// Fixed size log-bucketed histogram of latencies (HDR-style).
+// Values are grouped by position of the highest set bit and SUB_BUCKET_BITS following bits,
+// so reported values differ from recorded ones by at most 1/2^(SUB_BUCKET_BITS+1).
+// Samples are kept in two halves of time window: current and previous one,
+// queries take both into account.
+class LatencyHistogram {
+public:
+    using latency_t = std::chrono::microseconds;
+
+    LatencyHistogram();
+
+    // O(1)
+    void add(latency_t latency);
+
+    // drops previous half of window, current one becomes previous
+    void rotate();
+    void clear();
+
+    u32 getCount() const;
+
+    // percentile in [0; 100]
+    latency_t getPercentile(double percentile) const;
+    latency_t getMax() const;
+
+private:
+    static constexpr unsigned SUB_BUCKET_BITS = 3;
+    static constexpr unsigned SUB_BUCKETS_COUNT = 1 << SUB_BUCKET_BITS;
+    // 2^24 us ~ 16s, greater values are clamped
+    static constexpr unsigned VALUE_BITS = 24;
+    static constexpr u32 MAX_VALUE = (1 << VALUE_BITS) - 1;
+    static constexpr unsigned BUCKETS_COUNT =
+        (VALUE_BITS - SUB_BUCKET_BITS + 1) * SUB_BUCKETS_COUNT;
+
+    struct Counts {
+        u16 total;
+        u32 max;
+        u16 buckets[BUCKETS_COUNT];
+    };
+
+    unsigned current;
+    Counts halves[2];
+
+    static unsigned bucketIdx(u32 value);
+    static u32 bucketValue(unsigned idx);
+};
+
+#endif
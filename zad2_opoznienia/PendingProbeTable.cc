@@ -0,0 +1,77 @@
+#include <stdexcept>
+
+#include "PendingProbeTable.h"
+
+PendingProbeTable::PendingProbeTable(unsigned capacityBits)
+    : slots(2u << capacityBits),
+      slotsMask((2u << capacityBits) - 1),
+      order(1u << capacityBits),
+      orderMask((1u << capacityBits) - 1),
+      orderBegin(0),
+      orderEnd(0),
+      count(0) {
+    if (capacityBits >= 31) {
+        throw std::logic_error("capacity too big");
+    }
+}
+
+unsigned PendingProbeTable::size() const {
+    return count;
+}
+
+bool PendingProbeTable::remove(u32 peer, u64 id, Probe &probe) {
+    u32 idx = find(peer, id);
+    if (idx == slots.size()) {
+        return false;
+    }
+    probe = slots[idx].probe;
+    removeSlot(idx);
+    return true;
+}
+
+u32 PendingProbeTable::find(u32 peer, u64 id) const {
+    for (u32 idx = slotIdx(peer, id);; idx = (idx + 1) & slotsMask) {
+        const Slot &slot = slots[idx];
+        if (!slot.used) {
+            return slots.size();
+        }
+        if (slot.probe.peer == peer && slot.probe.id == id) {
+            return idx;
+        }
+    }
+}
+
+void PendingProbeTable::insertSlot(const Probe &probe) {
+    u32 idx = slotIdx(probe.peer, probe.id);
+    while (slots[idx].used) {
+        if (slots[idx].probe.peer == probe.peer && slots[idx].probe.id == probe.id) {
+            // same probe sent again, keep the newer one
+            slots[idx].probe = probe;
+            return;
+        }
+        idx = (idx + 1) & slotsMask;
+    }
+    slots[idx].probe = probe;
+    slots[idx].used = true;
+    count++;
+}
+
+void PendingProbeTable::removeSlot(u32 idx) {
+    // backward shift deletion, no tombstones
+    u32 hole = idx;
+    for (u32 next = (idx + 1) & slotsMask; slots[next].used; next = (next + 1) & slotsMask) {
+        u32 home = slotIdx(slots[next].probe.peer, slots[next].probe.id);
+        // move entry into hole unless its home lies cyclically in (hole; next]
+        if (((next - home) & slotsMask) >= ((next - hole) & slotsMask)) {
+            slots[hole] = slots[next];
+            hole = next;
+        }
+    }
+    slots[hole].used = false;
+    count--;
+}
+
+u32 PendingProbeTable::slotIdx(u32 peer, u64 id) const {
+    u64 hash = (id ^ ((u64)peer << 32 | peer)) * 0x9E3779B97F4A7C15ull;
+    return (u32)(hash >> 32) & slotsMask;
+}
@@ -0,0 +1,93 @@
+#ifndef PENDING_PROBE_TABLE__H
+#define PENDING_PROBE_TABLE__H
+
+#include <vector>
+
+#include "bitops.h"
+
+// Probes waiting for response, keyed by (peer, id).
+// Open addressing with linear probing plus FIFO ring of probes in order of sending,
+// both preallocated - inserting, removing and expiring probes don't allocate.
+// Not thread-safe.
+class PendingProbeTable {
+public:
+    struct Probe {
+        u32 peer;
+        u64 id;
+        u64 sendTime;
+    };
+
+    // at most 2^capacityBits probes are pending at the same time
+    PendingProbeTable(unsigned capacityBits);
+
+    unsigned size() const;
+
+    // oldest probe is expired if table is full
+    // sendTime has to be non-decreasing between calls
+    template <typename F>
+    void insert(const Probe &probe, F onExpired);
+
+    // returns true and fills probe if (peer, id) was pending
+    bool remove(u32 peer, u64 id, Probe &probe);
+
+    // removes at most maxCount probes sent before deadline, oldest first
+    template <typename F>
+    void expire(u64 deadline, unsigned maxCount, F onExpired);
+
+private:
+    struct Slot {
+        Probe probe;
+        bool used;
+    };
+
+    std::vector<Slot> slots;
+    u32 slotsMask;
+
+    // probes in order of sending, some of them may be already removed from slots
+    std::vector<Probe> order;
+    u32 orderMask;
+    u32 orderBegin;
+    u32 orderEnd;
+
+    unsigned count;
+
+    u32 find(u32 peer, u64 id) const;
+    void insertSlot(const Probe &probe);
+    void removeSlot(u32 idx);
+    u32 slotIdx(u32 peer, u64 id) const;
+};
+
+template <typename F>
+void PendingProbeTable::insert(const Probe &probe, F onExpired) {
+    if (orderEnd - orderBegin > orderMask) {
+        Probe oldest = order[orderBegin++ & orderMask];
+        u32 idx = find(oldest.peer, oldest.id);
+        if (idx != slots.size() && slots[idx].probe.sendTime == oldest.sendTime) {
+            removeSlot(idx);
+            onExpired(oldest);
+        }
+    }
+
+    order[orderEnd++ & orderMask] = probe;
+    insertSlot(probe);
+}
+
+template <typename F>
+void PendingProbeTable::expire(u64 deadline, unsigned maxCount, F onExpired) {
+    while (maxCount > 0 && orderBegin != orderEnd) {
+        const Probe &oldest = order[orderBegin & orderMask];
+        if (oldest.sendTime >= deadline) {
+            break;
+        }
+
+        u32 idx = find(oldest.peer, oldest.id);
+        if (idx != slots.size() && slots[idx].probe.sendTime == oldest.sendTime) {
+            removeSlot(idx);
+            onExpired(oldest);
+        }
+        orderBegin++;
+        maxCount--;
+    }
+}
+
+#endif
@@ -0,0 +1,223 @@
+#include <algorithm>
+#include <boost/bind.hpp>
+
+#include "ProbeScheduler.h"
+
+constexpr std::chrono::milliseconds ProbeScheduler::TICK;
+constexpr std::chrono::seconds ProbeScheduler::HOSTS_REFRESH;
+
+ProbeScheduler::ProbeScheduler(boost::asio::io_service &ioService,
+                               LatencyDatabase &latencyDatabase, UDPService &udp,
+                               ICMPService &icmp, TCPService &tcp, std::chrono::seconds interval,
+                               unsigned maxPacketsPerSecond, unsigned trainLength)
+    : timer(ioService),
+      latencyDatabase(latencyDatabase),
+      udp(udp),
+      icmp(icmp),
+      tcp(tcp),
+      interval(std::max(clock_t::duration(interval), clock_t::duration(TICK))),
+      maxPacketsPerSecond(maxPacketsPerSecond),
+      trainLength(std::max(trainLength, 1u)),
+      packetsBudget(0) {
+}
+
+void ProbeScheduler::start() {
+    auto now = clock_t::now();
+    nextTick = now;
+    nextHostsRefresh = now;
+    budgetUpdate = now;
+    asyncWait();
+}
+
+void ProbeScheduler::asyncWait() {
+    // deadlines are counted from previous deadline, not from handler execution time
+    nextTick += TICK;
+    timer.expires_at(nextTick);
+    timer.async_wait(
+        boost::bind(&ProbeScheduler::handleTick, this, boost::asio::placeholders::error));
+}
+
+void ProbeScheduler::handleTick(const boost::system::error_code &error) {
+    if (error) {
+        return;
+    }
+
+    auto now = clock_t::now();
+    if (now >= nextHostsRefresh) {
+        refreshHosts(now);
+        nextHostsRefresh += HOSTS_REFRESH;
+        if (nextHostsRefresh <= now) {
+            nextHostsRefresh = now + HOSTS_REFRESH;
+        }
+    }
+    updateBudget(now);
+
+    udpAddrs.clear();
+    udpTargets.clear();
+    tcpTargets.clear();
+    while (!queue.empty() && queue.top().first <= now) {
+        auto entry = queue.top();
+        auto it = hosts.find(entry.second);
+        if (it == hosts.end() || it->second.nextProbe != entry.first) {
+            queue.pop();
+            continue;
+        }
+
+        auto &host = it->second;
+        unsigned packets = packetsCount(host);
+        if (maxPacketsPerSecond && packetsBudget < packets) {
+            // the rest waits for next tick
+            break;
+        }
+        queue.pop();
+        packetsBudget -= packets;
+
+        auto addr = bitops::u32ToAddr(entry.second);
+        if (!host.trainRemaining) {
+            host.trainRemaining = trainLength;
+            host.roundStart = host.nextProbe;
+            if (trainLength > 1) {
+                latencyDatabase.beginTrain(addr);
+            }
+        }
+        host.trainRemaining--;
+
+        if (host.udp) {
+            udpAddrs.push_back(addr);
+            for (unsigned i = 0; i < host.udpPortsCount; i++) {
+                udpTargets.emplace_back(addr, host.udpPorts[i]);
+            }
+        }
+        if (host.tcp) {
+            tcpTargets.emplace_back(addr, host.tcpPort);
+        }
+
+        scheduleNextProbe(host, now);
+        queue.push(std::make_pair(host.nextProbe, entry.second));
+    }
+
+    if (!udpAddrs.empty()) {
+        udp.measureLatency(udpTargets);
+        icmp.measureLatency(udpAddrs);
+    }
+    if (!tcpTargets.empty()) {
+        tcp.measureLatency(tcpTargets);
+    }
+
+    if (nextTick + TICK < now) {
+        // handler was late by more than one tick, don't try to catch up
+        nextTick = now;
+    }
+    asyncWait();
+}
+
+void ProbeScheduler::refreshHosts(time_point_t now) {
+    auto snapshot = latencyDatabase.getSnapshot();
+
+    std::map<u32, HostState> refreshed;
+    for (const auto &entry : snapshot->hosts) {
+        u32 addr = bitops::addrToU32(entry.first);
+        const auto &host = entry.second;
+
+        HostState state;
+        state.udp = host.isProtocolAvailable(LatencyDatabase::ProtocolType::UDP);
+        state.tcp = host.isProtocolAvailable(LatencyDatabase::ProtocolType::TCP);
+        state.udpPortsCount = host.getUDPPortsCount();
+        for (unsigned i = 0; i < state.udpPortsCount; i++) {
+            state.udpPorts[i] = host.getUDPPort(i);
+        }
+        state.tcpPort = host.getTCPPort();
+        state.period = calcPeriod(host);
+
+        auto it = hosts.find(addr);
+        if (it != hosts.end()) {
+            state.nextProbe = it->second.nextProbe;
+            state.roundStart = it->second.roundStart;
+            state.trainRemaining = it->second.trainRemaining;
+        } else {
+            state.nextProbe = phaseOffset(addr, now);
+            state.roundStart = state.nextProbe;
+            state.trainRemaining = 0;
+            queue.push(std::make_pair(state.nextProbe, addr));
+        }
+        refreshed.emplace_hint(refreshed.end(), addr, state);
+    }
+
+    // hosts lost TCP or expired altogether
+    std::vector<addr_t> tcpExpired;
+    for (const auto &entry : hosts) {
+        auto it = refreshed.find(entry.first);
+        if (entry.second.tcp && (it == refreshed.end() || !it->second.tcp)) {
+            tcpExpired.push_back(bitops::u32ToAddr(entry.first));
+        }
+    }
+    if (!tcpExpired.empty()) {
+        tcp.forgetHosts(tcpExpired);
+    }
+    hosts.swap(refreshed);
+}
+
+ProbeScheduler::clock_t::duration ProbeScheduler::calcPeriod(
+    const LatencyDatabase::Host &host) const {
+    // below spreadLow latency is stable, above spreadHigh it varies
+    static const double spreadLow = 0.1;
+    static const double spreadHigh = 0.5;
+
+    if (!host.isAnyLatencyKnown()) {
+        // stale, probe faster to get first samples
+        return interval / 2;
+    }
+
+    double maxSpread = 0;
+    for (auto protocol : LatencyDatabase::allProtocols) {
+        if (host.isLatencyKnown(protocol)) {
+            double median = std::max<double>(host.getLatency(protocol).count(), 1);
+            double p90 = host.getLatencyPercentile(protocol, 90).count();
+            maxSpread = std::max(maxSpread, (p90 - median) / median);
+        }
+    }
+
+    if (maxSpread > spreadHigh) {
+        return interval / 2;
+    }
+    if (maxSpread < spreadLow) {
+        return interval * 2;
+    }
+    return interval;
+}
+
+ProbeScheduler::time_point_t ProbeScheduler::phaseOffset(u32 addr, time_point_t now) const {
+    // the same host gets the same phase, different hosts are spread over whole interval
+    u64 hash = (u64)(addr * 2654435761u);
+    // interval in nanoseconds times 32-bit hash doesn't fit in u64
+    return now + clock_t::duration(
+                     (clock_t::rep)((unsigned __int128)hash * (u64)interval.count() >> 32));
+}
+
+void ProbeScheduler::scheduleNextProbe(HostState &host, time_point_t now) {
+    if (host.trainRemaining) {
+        host.nextProbe = now + TICK;
+    } else {
+        // rounds are counted from start of previous round, so trains don't shift them
+        host.nextProbe = std::max(host.roundStart + host.period, now);
+    }
+}
+
+void ProbeScheduler::updateBudget(time_point_t now) {
+    if (!maxPacketsPerSecond) {
+        return;
+    }
+    double elapsed = std::chrono::duration<double>(now - budgetUpdate).count();
+    budgetUpdate = now;
+
+    // allows short bursts, at most one tenth of second of traffic,
+    // but always enough for one host, otherwise the host at the front would block the queue
+    static const double maxPacketsPerHost = MAX_INSTANCES_PER_HOST + 2;
+    double maxBudget = std::max(maxPacketsPerSecond / 10.0, maxPacketsPerHost);
+    packetsBudget = std::min(packetsBudget + elapsed * maxPacketsPerSecond, maxBudget);
+}
+
+unsigned ProbeScheduler::packetsCount(const HostState &host) const {
+    // UDP to every instance and ICMP are sent to UDP hosts
+    return (host.udp ? host.udpPortsCount + 1 : 0) + (host.tcp ? 1 : 0);
+}
@@ -0,0 +1,100 @@
+#ifndef PROBE_SCHEDULER__H
+#define PROBE_SCHEDULER__H
+
+#include <chrono>
+#include <functional>
+#include <map>
+#include <queue>
+#include <boost/asio.hpp>
+#include <boost/asio/steady_timer.hpp>
+
+#include "ICMPService.h"
+#include "LatencyDatabase.h"
+#include "TCPService.h"
+#include "UDPService.h"
+#include "bitops.h"
+
+// Probes every host from database once per its own period.
+// Hosts start with phase offsets spread over the base interval, so probes are sent evenly
+// instead of in one burst. Period of host is shortened when its latency is unknown or varies
+// and lengthened when latency is stable. Packets per second can be limited globally.
+// In train mode each round is a train of probes paced one TICK apart.
+// Database is told when train begins, it aggregates replies of train.
+// Runs on timer of given io_service, handlers are not executed concurrently.
+class ProbeScheduler {
+public:
+    // maxPacketsPerSecond - 0 means no limit
+    // trainLength - probes per host per round
+    ProbeScheduler(boost::asio::io_service &ioService, LatencyDatabase &latencyDatabase,
+                   UDPService &udp, ICMPService &icmp, TCPService &tcp,
+                   std::chrono::seconds interval, unsigned maxPacketsPerSecond,
+                   unsigned trainLength = 1);
+    ProbeScheduler(const ProbeScheduler &) = delete;
+    ProbeScheduler(ProbeScheduler &&) = delete;
+    ProbeScheduler &operator=(const ProbeScheduler &) = delete;
+    ProbeScheduler &operator=(ProbeScheduler &&) = delete;
+
+    void start();
+
+private:
+    using clock_t = std::chrono::steady_clock;
+    using time_point_t = clock_t::time_point;
+    using addr_t = LatencyDatabase::addr_t;
+
+    static constexpr std::chrono::milliseconds TICK = std::chrono::milliseconds(10);
+    // how often set of hosts and their periods are taken from database
+    static constexpr std::chrono::seconds HOSTS_REFRESH = std::chrono::seconds(1);
+
+    struct HostState {
+        time_point_t nextProbe;
+        time_point_t roundStart;
+        clock_t::duration period;
+        // probes of current train not sent yet
+        unsigned trainRemaining;
+        bool udp;
+        bool tcp;
+        // 0 - service default
+        u16 udpPorts[MAX_INSTANCES_PER_HOST];
+        unsigned udpPortsCount;
+        u16 tcpPort;
+    };
+
+    boost::asio::steady_timer timer;
+    time_point_t nextTick;
+    time_point_t nextHostsRefresh;
+
+    LatencyDatabase &latencyDatabase;
+    UDPService &udp;
+    ICMPService &icmp;
+    TCPService &tcp;
+
+    const clock_t::duration interval;
+    const unsigned maxPacketsPerSecond;
+    const unsigned trainLength;
+    double packetsBudget;
+    time_point_t budgetUpdate;
+
+    std::map<u32, HostState> hosts;
+    // (next probe, host), entries not matching hosts are outdated
+    std::priority_queue<std::pair<time_point_t, u32>,
+                        std::vector<std::pair<time_point_t, u32>>,
+                        std::greater<std::pair<time_point_t, u32>>>
+        queue;
+
+    std::vector<addr_t> udpAddrs;
+    std::vector<boost::asio::ip::udp::endpoint> udpTargets;
+    std::vector<boost::asio::ip::tcp::endpoint> tcpTargets;
+
+    void asyncWait();
+    void handleTick(const boost::system::error_code &error);
+
+    void refreshHosts(time_point_t now);
+    clock_t::duration calcPeriod(const LatencyDatabase::Host &host) const;
+    time_point_t phaseOffset(u32 addr, time_point_t now) const;
+
+    void updateBudget(time_point_t now);
+    unsigned packetsCount(const HostState &host) const;
+    void scheduleNextProbe(HostState &host, time_point_t now);
+};
+
+#endif
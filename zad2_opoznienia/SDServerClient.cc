@@ -1,12 +1,12 @@
+#include <algorithm>
 #include <iostream>
 #include <exception>
-#include <thread>
 #include <chrono>
 #include <cstdint>
 #include <boost/bind.hpp>
-#include <ifaddrs.h>
 
 #include "DNSPacket.h"
+#include "DNSPacketView.h"
 #include "SDServerClient.h"
 #include "bitops.h"
 #include "dns_format.h"
@@ -14,14 +14,24 @@
 
 const std::string SDServerClient::TCP_SERVICE = "_ssh._tcp.local.";
 const std::string SDServerClient::OPOZNIENIA_SERVICE = "_opoznienia._udp.local.";
+const std::vector<std::string> SDServerClient::lookedUpServices = {TCP_SERVICE,
+                                                                   OPOZNIENIA_SERVICE};
+const std::chrono::seconds SDServerClient::EVICTION_INTERVAL(60);
 const SDServerClient::endpoint_t SDServerClient::MDNS_MULTICAST_EP(
     boost::asio::ip::address::from_string("224.0.0.251"), 5353);
 
-SDServerClient::SDServerClient(LatencyDatabase &latencyDatabase)
-    : hostname(boost::asio::ip::host_name()),
+SDServerClient::SDServerClient(boost::asio::io_service &ioService,
+                               LatencyDatabase &latencyDatabase, u16 udpPort)
+    : udpPort(udpPort),
+      hostname(boost::asio::ip::host_name()),
       hostnameEstablished(false),
-      ioService(),
+      ioService(ioService),
+      interfaces(ioService),
       socket(ioService),
+      lookupTimer(ioService),
+      unicastResponseRequested(true),
+      knownHosts(KNOWN_HOSTS_BITS),
+      evictionTimer(ioService),
       buffer(BUFFER_SIZE),
       latencyDatabase(latencyDatabase) {
     hostname = "Spa";
@@ -33,9 +43,15 @@ void SDServerClient::run(std::chrono::seconds lookupInterval, bool tcpAvailable)
         prepareSocket();
         this->tcpAvailable = tcpAvailable;
 
-        receiveThread = std::thread(&SDServerClient::receiveThreadFunc, this);
-        lookupThread =
-            std::thread(&SDServerClient::multicastLookupThreadFunc, this, lookupInterval);
+        this->lookupInterval = lookupInterval;
+
+        interfaces.setOnChange([this]() { forgetAddressResponses(); });
+        interfaces.start();
+        asyncReceive();
+        lookupTimer.expires_from_now(std::chrono::seconds(0));
+        asyncLookup();
+        evictionTimer.expires_from_now(EVICTION_INTERVAL);
+        asyncEviction();
         running = true;
     } else {
         throw std::logic_error("already running");
@@ -58,37 +74,174 @@ void SDServerClient::prepareSocket() {
     }
 }
 
-void SDServerClient::multicastLookupThreadFunc(std::chrono::seconds lookupInterval) {
-    prepareQueryPacket(true);
-    bool unicastQueryDisabled = false;
+void SDServerClient::asyncLookup() {
+    lookupTimer.async_wait(
+        boost::bind(&SDServerClient::handleLookup, this, boost::asio::placeholders::error));
+}
 
-    while (true) {
-        send(queryPTRPacket.generateNetworkFormat(), MDNS_MULTICAST_EP);
-        std::this_thread::sleep_for(lookupInterval);
+void SDServerClient::handleLookup(const boost::system::error_code &error) {
+    if (error) {
+        return;
+    }
+    // first lookup asks for unicast responses and runs right away,
+    // hostname is chosen after responses to it had time to come
+    if (!unicastResponseRequested && !hostnameEstablished) {
+        prepareHostname();
+    }
+    sendLookupQuery(unicastResponseRequested);
+    unicastResponseRequested = false;
+
+    // late lookup is not caught up
+    lookupTimer.expires_at(
+        std::max(lookupTimer.expires_at() + lookupInterval, std::chrono::steady_clock::now()));
+    asyncLookup();
+}
 
-        if (!unicastQueryDisabled) {
-            unicastQueryDisabled = true;
-            prepareQueryPacket(false);
+void SDServerClient::asyncEviction() {
+    evictionTimer.async_wait(
+        boost::bind(&SDServerClient::handleEviction, this, boost::asio::placeholders::error));
+}
+
+void SDServerClient::handleEviction(const boost::system::error_code &error) {
+    if (error) {
+        return;
+    }
+    auto now = std::chrono::system_clock::now();
+    knownHostsMutex.lock();
+    knownHosts.evict(now);
+    knownHostsMutex.unlock();
+
+    instancesMutex.lock();
+    for (auto it = instances.begin(); it != instances.end();) {
+        if (it->second.expiration < now) {
+            it = instances.erase(it);
+        } else {
+            ++it;
+        }
+    }
+    instancesMutex.unlock();
+
+    evictionTimer.expires_from_now(EVICTION_INTERVAL);
+    asyncEviction();
+}
+
+void SDServerClient::sendLookupQuery(bool unicastResponseRequested) {
+    auto now = std::chrono::system_clock::now();
+    DNSPacket packet;
+    std::vector<DNSPacket::ResourceRecord> answers;
+
+    knownAnswersMutex.lock();
+    bool lookedUp[2] = {false, false};
+    for (unsigned i = 0; i < lookedUpServices.size(); i++) {
+        // query of another host answered by the same responses counts as ours
+        if (!unicastResponseRequested && duplicateQuestions[i] > lastLookup) {
+            continue;
+        }
+        DNSPacket::Question q;
+        q.qtype = DNSPacket::DNSType::PTR;
+        q.qclass = DNSPacket::DNSClass::IN;
+        q.unicastResponseRequested = unicastResponseRequested;
+        q.qname = dns_format::stringToDomain(lookedUpServices[i]);
+        packet.addQuestion(q);
+        lookedUp[i] = true;
+    }
+    lastLookup = now;
+
+    for (auto it = knownAnswers.begin(); it != knownAnswers.end();) {
+        if (it->second.expiration <= now) {
+            it = knownAnswers.erase(it);
+            continue;
+        }
+        auto remaining =
+            std::chrono::duration_cast<std::chrono::seconds>(it->second.expiration - now).count();
+        auto service = dns_format::withoutFirstLabel(it->first);
+        auto serviceName = dns_format::domainToString(service);
+        // records past half of TTL are not listed, so that responders refresh them
+        for (unsigned i = 0; i < lookedUpServices.size(); i++) {
+            if (lookedUp[i] && serviceName == lookedUpServices[i] &&
+                (u32)remaining * 2 >= it->second.ttl) {
+                DNSPacket::ResourceRecord answer = generatePlainAnswer();
+                answer.name = service;
+                answer.ttl = remaining;
+                answer.setPTRAnswer(it->first);
+                answers.push_back(std::move(answer));
+            }
         }
-        if (!hostnameEstablished) {
-            prepareHostname();
+        ++it;
+    }
+    knownAnswersMutex.unlock();
+
+    if (packet.getQuestions().empty()) {
+        return;
+    }
+
+    // RFC 6762 7.2, known answers which don't fit follow in packets without questions
+    std::size_t size = packet.generateNetworkFormat().size();
+    for (auto &answer : answers) {
+        std::size_t answerSize = answer.generateNetworkFormat().size();
+        if (!packet.getAnswers().empty() && size + answerSize > MAX_AGGREGATED_SIZE) {
+            packet.setTC(true);
+            send(packet.generateNetworkFormat(), MDNS_MULTICAST_EP);
+            packet = DNSPacket();
+            size = DNS_HEADER_SIZE;
         }
+        size += answerSize;
+        packet.addAnswer(std::move(answer));
     }
+    send(packet.generateNetworkFormat(), MDNS_MULTICAST_EP);
 }
 
-void SDServerClient::prepareQueryPacket(bool unicastResponseRequested) {
-    queryPTRPacket = DNSPacket();
-    DNSPacket::Question q;
+void SDServerClient::addKnownAnswer(const std::vector<u8> &instance, u32 ttl) {
+    std::lock_guard<std::mutex> lock(knownAnswersMutex);
+    knownAnswers[instance] =
+        KnownAnswer{std::chrono::system_clock::now() + std::chrono::seconds(ttl), ttl};
+}
 
-    q.qtype = DNSPacket::DNSType::PTR;
-    q.qclass = DNSPacket::DNSClass::IN;
-    q.unicastResponseRequested = unicastResponseRequested;
+void SDServerClient::handleDuplicateQuestions(const DNSPacket &packet) {
+    // known answers of truncated query continue in next packets
+    if (packet.getTC()) {
+        return;
+    }
 
-    q.qname = dns_format::stringToDomain(TCP_SERVICE);
-    queryPTRPacket.addQuestion(q);
+    std::lock_guard<std::mutex> lock(knownAnswersMutex);
+    for (const auto &q : packet.getQuestions()) {
+        if (q.qtype != DNSPacket::DNSType::PTR || q.unicastResponseRequested) {
+            continue;
+        }
+        for (unsigned i = 0; i < lookedUpServices.size(); i++) {
+            if (q.qname != dns_format::stringToDomain(lookedUpServices[i])) {
+                continue;
+            }
+            // responses to that query have to cover everything we don't know yet
+            bool covered = true;
+            for (const auto &rr : packet.getAnswers()) {
+                if (rr.getRRType() == DNSPacket::DNSType::PTR && rr.name == q.qname &&
+                    knownAnswers.find(rr.getPtrAnswer()) == knownAnswers.end()) {
+                    covered = false;
+                }
+            }
+            if (covered) {
+                duplicateQuestions[i] = std::chrono::system_clock::now();
+            }
+        }
+    }
+}
 
-    q.qname = dns_format::stringToDomain(OPOZNIENIA_SERVICE);
-    queryPTRPacket.addQuestion(q);
+bool SDServerClient::isKnownAnswer(const DNSPacket &packet, const DNSPacket::Question &q,
+                                   endpoint_t senderEndpoint) {
+    if (packet.getAnswers().empty()) {
+        return false;
+    }
+    CachedResponse response;
+    if (!getResponse(q, senderEndpoint, response)) {
+        return false;
+    }
+    for (const auto &rr : packet.getAnswers()) {
+        if (rr.ttl >= DEFAULT_TTL / 2 && response.matches(rr)) {
+            return true;
+        }
+    }
+    return false;
 }
 
 void SDServerClient::prepareHostname() {
@@ -98,11 +251,28 @@ void SDServerClient::prepareHostname() {
         newHostname = hostname + "-" + std::to_string(i++);
     } while (isHostKnown(dns_format::stringToDomain(newHostname)));
     hostname = newHostname;
+    prepareResponses();
     hostnameEstablished = true;
     std::cout << "Hostname: " << hostname << std::endl;
 }
 
-void SDServerClient::receiveThreadFunc() {
+void SDServerClient::asyncReceive() {
+    socket.async_wait(
+        boost::asio::ip::udp::socket::wait_read,
+        boost::bind(&SDServerClient::handleReceive, this, boost::asio::placeholders::error));
+}
+
+void SDServerClient::handleReceive(const boost::system::error_code &error) {
+    if (error == boost::asio::error::operation_aborted) {
+        return;
+    }
+    if (error) {
+        // transient errors don't stop receiving
+        std::cerr << __func__ << ": " << error.message() << "\n";
+        asyncReceive();
+        return;
+    }
+
     iovec iov;
     iov.iov_base = buffer.data();
     iov.iov_len = buffer.size();
@@ -120,58 +290,100 @@ void SDServerClient::receiveThreadFunc() {
     msgInfo.msg_control = cmbuf;
     msgInfo.msg_controllen = sizeof(cmbuf);
 
-    int native_socket = socket.native_handle();
-    while (true) {
-        ssize_t recLen = recvmsg(native_socket, &msgInfo, 0);
+    ssize_t recLen = recvmsg(socket.native_handle(), &msgInfo, MSG_DONTWAIT);
 
-        bool found = false;
-        for (cmsghdr *cmsg = CMSG_FIRSTHDR(&msgInfo); cmsg && !found;
-             cmsg = CMSG_NXTHDR(&msgInfo, cmsg)) {
-            if (cmsg->cmsg_level == IPPROTO_IP && cmsg->cmsg_type == IP_PKTINFO) {
-                pktinfo = *((in_pktinfo *)CMSG_DATA(cmsg));
-                found = true;
-            }
+    bool found = false;
+    for (cmsghdr *cmsg = CMSG_FIRSTHDR(&msgInfo); recLen != -1 && cmsg && !found;
+         cmsg = CMSG_NXTHDR(&msgInfo, cmsg)) {
+        if (cmsg->cmsg_level == IPPROTO_IP && cmsg->cmsg_type == IP_PKTINFO) {
+            pktinfo = *((in_pktinfo *)CMSG_DATA(cmsg));
+            found = true;
         }
+    }
 
-        if (recLen == -1 || !found) {
+    if (recLen == -1 || !found) {
+        if (recLen != -1 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
             std::cerr << __func__ << ": " << strerror(errno) << "\n";
-        } else {
-            endpoint_t senderEndpoint;
-            senderEndpoint.address(
-                boost::asio::ip::address_v4(bitops::ntoh(peeraddr.sin_addr.s_addr)));
-            senderEndpoint.port(bitops::ntoh(peeraddr.sin_port));
+        }
+    } else {
+        endpoint_t senderEndpoint;
+        senderEndpoint.address(boost::asio::ip::address_v4(bitops::ntoh(peeraddr.sin_addr.s_addr)));
+        senderEndpoint.port(bitops::ntoh(peeraddr.sin_port));
 
-            endpoint_t msgDestination;
-            msgDestination.address(
-                boost::asio::ip::address_v4(bitops::ntoh(pktinfo.ipi_addr.s_addr)));
-            msgDestination.port(MDNS_MULTICAST_EP.port());
+        endpoint_t msgDestination;
+        msgDestination.address(
+            boost::asio::ip::address_v4(bitops::ntoh(pktinfo.ipi_addr.s_addr)));
+        msgDestination.port(MDNS_MULTICAST_EP.port());
 
-            receiveMessage(senderEndpoint, msgDestination, recLen);
-        }
+        receiveMessage(senderEndpoint, msgDestination, recLen);
     }
+    asyncReceive();
 }
 
 void SDServerClient::receiveMessage(endpoint_t senderEndpoint, endpoint_t msgDestination,
                                     std::size_t bytesToRead) {
-    DNSPacket receivedPacket;
-    try {
-        receivedPacket = DNSPacket(buffer, bytesToRead);
-    } catch (UnknownFormatException &) {
+    // most of mDNS traffic on segment is not about our services,
+    // so it is dropped before anything is allocated
+    DNSPacketView view(buffer.data(), bytesToRead);
+    if (!view.isValid() || ignorePacket(view, senderEndpoint)) {
         return;
     }
 
-    if (ignorePacket(receivedPacket, senderEndpoint)) {
+    bool query = view.getQR() == DNSPacket::DNSQR::QUESTION && hostnameEstablished;
+    if (query ? !hasSupportedQuestion(view) : !hasSupportedAnswer(view)) {
         return;
     }
 
-    if (receivedPacket.getQR() == DNSPacket::DNSQR::QUESTION && hostnameEstablished) {
+    DNSPacket receivedPacket(view);
+    if (query) {
         handleQuestions(receivedPacket, senderEndpoint, msgDestination != MDNS_MULTICAST_EP);
     } else {
         handleResponses(receivedPacket, senderEndpoint);
     }
 }
 
-bool SDServerClient::ignorePacket(const DNSPacket &packet, endpoint_t senderEndpoint) const {
+bool SDServerClient::hasSupportedQuestion(const DNSPacketView &packet) const {
+    bool found = false;
+    packet.forEachQuestion([&found](const DNSPacketView::Question &q) {
+        bool supportedType = q.qtype == DNSPacket::DNSType::PTR ||
+                             q.qtype == DNSPacket::DNSType::A ||
+                             q.qtype == DNSPacket::DNSType::SRV ||
+                             q.qtype == DNSPacket::DNSType::TXT;
+        if (supportedType && q.qclass == DNSPacket::DNSClass::IN && isServiceName(q.qname)) {
+            found = true;
+        }
+    });
+    return found;
+}
+
+bool SDServerClient::hasSupportedAnswer(const DNSPacketView &packet) const {
+    bool found = false;
+    packet.forEachAnswer([&found](const DNSPacketView::ResourceRecord &rr) {
+        bool supportedType = rr.rrtype == DNSPacket::DNSType::PTR ||
+                             rr.rrtype == DNSPacket::DNSType::A ||
+                             rr.rrtype == DNSPacket::DNSType::SRV;
+        if (supportedType && isServiceName(rr.name)) {
+            found = true;
+        }
+    });
+    return found;
+}
+
+bool SDServerClient::isServiceName(const DNSPacketView::Name &name) {
+    static const std::vector<u8> tcpService = dns_format::stringToDomain(TCP_SERVICE);
+    static const std::vector<u8> opozService = dns_format::stringToDomain(OPOZNIENIA_SERVICE);
+
+    if (name.equals(tcpService) || name.equals(opozService)) {
+        return true;
+    }
+    if (name.isRoot()) {
+        return false;
+    }
+    auto service = name.withoutFirstLabel();
+    return service.equals(tcpService) || service.equals(opozService);
+}
+
+bool SDServerClient::ignorePacket(const DNSPacketView &packet, endpoint_t senderEndpoint) const {
     if (packet.getOpcode() != 0) {
         return true;
     }
@@ -184,12 +396,22 @@ bool SDServerClient::ignorePacket(const DNSPacket &packet, endpoint_t senderEndp
 
 void SDServerClient::handleQuestions(const DNSPacket &packet, endpoint_t senderEndpoint,
                                      bool directedQuery) {
+    bool legacyQuery = senderEndpoint.port() != MDNS_MULTICAST_EP.port();
+    if (!legacyQuery) {
+        handleDuplicateQuestions(packet);
+    }
+
     for (const auto &q : packet.getQuestions()) {
         if (ignoreQuestion(q)) {
             continue;
         }
+        // RFC 6762 7.1, querier already has our answer
+        // known answers of truncated query which follow in next packets are not awaited
+        if (!legacyQuery && isKnownAnswer(packet, q, senderEndpoint)) {
+            continue;
+        }
 
-        if (senderEndpoint.port() != MDNS_MULTICAST_EP.port()) {
+        if (legacyQuery) {
             // TC legacy unicast queries are not supported
             if (!packet.getTC()) {
                 responseToLegacyUnicastQuery(packet.getID(), q, senderEndpoint);
@@ -203,15 +425,11 @@ void SDServerClient::handleQuestions(const DNSPacket &packet, endpoint_t senderE
 }
 
 bool SDServerClient::ignoreQuestion(const DNSPacket::Question &q) const {
-    if (q.qtype != DNSPacket::DNSType::PTR && q.qtype != DNSPacket::DNSType::A) {
+    if (q.qtype != DNSPacket::DNSType::PTR && q.qtype != DNSPacket::DNSType::A &&
+        q.qtype != DNSPacket::DNSType::SRV && q.qtype != DNSPacket::DNSType::TXT) {
         // unsupported type
         return true;
     }
-    if (!tcpAvailable && (q.qname == dns_format::stringToDomain(TCP_SERVICE) ||
-                          q.qname == dns_format::stringToDomain(hostname + "." + TCP_SERVICE))) {
-        // service not available
-        return true;
-    }
     if (q.qclass != DNSPacket::DNSClass::IN) {
         // unsupported class
         return true;
@@ -223,36 +441,21 @@ void SDServerClient::responseToLegacyUnicastQuery(u16 queryID, const DNSPacket::
                                                   endpoint_t senderEndpoint) {
     static const u32 max_ttl = 10;
 
-    DNSPacket::ResourceRecord answer;
-    if (q.qtype == DNSPacket::DNSType::PTR) {
-        answer = generatePTRAnswer(q);
-    } else if (q.qtype == DNSPacket::DNSPacket::A) {
-        answer = generateAAnswer(q, senderEndpoint);
-    }
-    answer.ttl = max_ttl;
-
-    if (answer.getRRType() == DNSPacket::DNSType::UNSUPPORTED) {
+    CachedResponse response;
+    if (!getResponse(q, senderEndpoint, response)) {
         return;
     }
-
-    DNSPacket response;
+    response.setTTL(max_ttl);
     response.setID(queryID);
-    response.setQR(DNSPacket::DNSQR::RESPONSE);
     response.addQuestion(q);
-    response.addAnswer(answer);
 
-    send(response.generateNetworkFormat(), senderEndpoint);
+    send(response.packet, senderEndpoint);
 }
 
 void SDServerClient::handleUnicastQuery(const DNSPacket::Question &q, endpoint_t senderEndpoint) {
     // if the responder has not multicast that record recently (within one quarter of its TTL)
     // multicast the response
-    unsigned time_idx;
-    if (q.qtype == DNSPacket::DNSType::PTR) {
-        time_idx = PTR_TIME_IDX;
-    } else {
-        time_idx = A_TIME_IDX;
-    }
+    unsigned time_idx = timeIndex(q.qtype);
 
     if (!lastMutlicastResponses[time_idx] ||
         *lastMutlicastResponses[time_idx] <
@@ -262,77 +465,127 @@ void SDServerClient::handleUnicastQuery(const DNSPacket::Question &q, endpoint_t
     }
 
     // unicast response
-    DNSPacket::ResourceRecord answer;
-    std::chrono::microseconds delay(0);
+    CachedResponse response;
+    if (!getResponse(q, senderEndpoint, response)) {
+        return;
+    }
+    std::chrono::milliseconds delay(0);
     if (q.qtype == DNSPacket::DNSType::PTR) {
-        answer = generatePTRAnswer(q);
         delay = delayForPTRResponse();
-    } else if (q.qtype == DNSPacket::DNSPacket::A) {
-        answer = generateAAnswer(q, senderEndpoint);
-    }
-
-    if (answer.getRRType() == DNSPacket::DNSType::UNSUPPORTED) {
-        return;
     }
 
-    DNSPacket response;
-    response.setQR(DNSPacket::DNSQR::RESPONSE);
-    response.addAnswer(answer);
-
-    send(response.generateNetworkFormat(), senderEndpoint, delay);
+    send(response.packet, senderEndpoint, delay);
 }
 
 void SDServerClient::responseViaMulticast(const DNSPacket::Question &q, endpoint_t senderEndpoint) {
-    DNSPacket::ResourceRecord answer;
-    std::chrono::microseconds delay(0);
-    unsigned time_idx = 0;
+    CachedResponse response;
+    if (!getResponse(q, senderEndpoint, response)) {
+        return;
+    }
+    std::chrono::milliseconds delay(0);
+    unsigned time_idx = timeIndex(q.qtype);
     if (q.qtype == DNSPacket::DNSType::PTR) {
-        answer = generatePTRAnswer(q);
         delay = delayForPTRResponse();
-        time_idx = PTR_TIME_IDX;
-    } else if (q.qtype == DNSPacket::DNSPacket::A) {
-        answer = generateAAnswer(q, senderEndpoint);
-        time_idx = A_TIME_IDX;
     }
 
-    if (answer.getRRType() == DNSPacket::DNSType::UNSUPPORTED) {
-        return;
-    }
-
-    DNSPacket response;
-    response.setQR(DNSPacket::DNSQR::RESPONSE);
-    response.addAnswer(answer);
-
-    send(response.generateNetworkFormat(), MDNS_MULTICAST_EP, delay);
+    send(response.packet, MDNS_MULTICAST_EP, delay);
     lastMutlicastResponses[time_idx].reset(
         new time_point_t(std::chrono::system_clock::now() + delay));
 }
 
-DNSPacket::ResourceRecord SDServerClient::generateAAnswer(const DNSPacket::Question &q,
-                                                          endpoint_t senderEndpoint) const {
-    auto res = generatePlainAnswer();
-    res.name = q.qname;
+unsigned SDServerClient::timeIndex(u16 qtype) {
+    switch (qtype) {
+        case DNSPacket::DNSType::PTR:
+            return PTR_TIME_IDX;
+        case DNSPacket::DNSType::SRV:
+            return SRV_TIME_IDX;
+        case DNSPacket::DNSType::TXT:
+            return TXT_TIME_IDX;
+        default:
+            return A_TIME_IDX;
+    }
+}
 
+void SDServerClient::prepareResponses() {
+    std::map<std::vector<u8>, NameResponses> prepared;
     for (const auto &srvc : {TCP_SERVICE, OPOZNIENIA_SERVICE}) {
-        if (q.qname == dns_format::stringToDomain(hostname + "." + srvc)) {
-            res.setAAnswer(bitops::addrToU32(getHostAddr(senderEndpoint.address().to_v4())));
+        if (srvc == TCP_SERVICE && !tcpAvailable) {
+            continue;
         }
+        auto service = dns_format::stringToDomain(srvc);
+        auto instance = dns_format::stringToDomain(hostname + "." + srvc);
+
+        auto answer = generatePlainAnswer();
+        answer.name = service;
+        answer.setPTRAnswer(instance);
+        prepared[service].ptr.reset(new CachedResponse(answer));
+
+        // target is instance name itself, as A record is kept on it
+        auto &instanceResponses = prepared[instance];
+        answer.name = instance;
+        answer.setSRVAnswer(0, 0, srvc == TCP_SERVICE ? TCP_PORT : udpPort, instance);
+        instanceResponses.srv.reset(new CachedResponse(answer));
+
+        // no attributes, but DNS-SD requires TXT record for every instance
+        answer.setTXTAnswer(std::vector<u8>());
+        instanceResponses.txt.reset(new CachedResponse(answer));
+
+        instanceResponses.instance = true;
     }
 
-    return res;
+    responsesMutex.lock();
+    responses.swap(prepared);
+    responsesMutex.unlock();
 }
 
-DNSPacket::ResourceRecord SDServerClient::generatePTRAnswer(const DNSPacket::Question &q) const {
-    auto res = generatePlainAnswer();
-    res.name = q.qname;
+void SDServerClient::forgetAddressResponses() {
+    std::lock_guard<std::mutex> lock(responsesMutex);
+    for (auto &entry : responses) {
+        entry.second.a.clear();
+    }
+}
 
-    for (const auto &srvc : {TCP_SERVICE, OPOZNIENIA_SERVICE}) {
-        if (q.qname == dns_format::stringToDomain(srvc)) {
-            res.setPTRAnswer(dns_format::stringToDomain(hostname + "." + srvc));
-        }
+bool SDServerClient::getResponse(const DNSPacket::Question &q, endpoint_t senderEndpoint,
+                                 CachedResponse &response) {
+    std::lock_guard<std::mutex> lock(responsesMutex);
+    auto it = responses.find(q.qname);
+    if (it == responses.end()) {
+        return false;
     }
 
-    return res;
+    auto &nameResponses = it->second;
+    const CachedResponse *cached = nullptr;
+    switch (q.qtype) {
+        case DNSPacket::DNSType::PTR:
+            cached = nameResponses.ptr.get();
+            break;
+        case DNSPacket::DNSType::SRV:
+            cached = nameResponses.srv.get();
+            break;
+        case DNSPacket::DNSType::TXT:
+            cached = nameResponses.txt.get();
+            break;
+        case DNSPacket::DNSType::A:
+            if (nameResponses.instance) {
+                // address depends on interface query came from
+                u32 addr = bitops::addrToU32(getHostAddr(senderEndpoint.address().to_v4()));
+                auto aIt = nameResponses.a.find(addr);
+                if (aIt == nameResponses.a.end()) {
+                    auto answer = generatePlainAnswer();
+                    answer.name = q.qname;
+                    answer.setAAnswer(addr);
+                    aIt = nameResponses.a.emplace(addr, CachedResponse(answer)).first;
+                }
+                cached = &aIt->second;
+            }
+            break;
+    }
+
+    if (!cached) {
+        return false;
+    }
+    response = *cached;
+    return true;
 }
 
 DNSPacket::ResourceRecord SDServerClient::generatePlainAnswer() const {
@@ -342,9 +595,9 @@ DNSPacket::ResourceRecord SDServerClient::generatePlainAnswer() const {
     return answer;
 }
 
-std::chrono::microseconds SDServerClient::delayForPTRResponse() const {
-    // [20; 120]
-    return std::chrono::microseconds(rand() % 101 + 20);
+std::chrono::milliseconds SDServerClient::delayForPTRResponse() const {
+    // [20; 120] ms, as RFC 6762 requires for shared records
+    return std::chrono::milliseconds(rand() % 101 + 20);
 }
 
 void SDServerClient::handleResponses(const DNSPacket &packet, endpoint_t senderEndpoint) {
@@ -357,6 +610,8 @@ void SDServerClient::handleResponses(const DNSPacket &packet, endpoint_t senderE
             handlePTRResponse(r);
         } else if (r.getRRType() == DNSPacket::DNSType::A) {
             handleAResponse(r);
+        } else if (r.getRRType() == DNSPacket::DNSType::SRV) {
+            handleSRVResponse(r);
         }
     }
 }
@@ -370,17 +625,33 @@ void SDServerClient::handlePTRResponse(const DNSPacket::ResourceRecord &response
     }
 
     addKnownHost(response.getPtrAnswer(), response.ttl);
-    sendAQuery(response.getPtrAnswer());
+    addKnownAnswer(response.getPtrAnswer(), response.ttl);
+
+    instancesMutex.lock();
+    auto it = instances.find(response.getPtrAnswer());
+    bool fresh = false;
+    if (it != instances.end()) {
+        extendExpiration(it->second, response.ttl);
+        fresh = it->second.addr && std::chrono::system_clock::now() < it->second.refreshAfter;
+    }
+    instancesMutex.unlock();
+    if (fresh) {
+        // address is still fresh, PTR only refreshed presence
+        return;
+    }
+    sendInstanceQuery(response.getPtrAnswer());
 }
 
-void SDServerClient::sendAQuery(const std::vector<u8> &domain) {
+void SDServerClient::sendInstanceQuery(const std::vector<u8> &domain) {
     DNSPacket::Question query;
     query.qname = domain;
     query.qclass = DNSPacket::DNSClass::IN;
-    query.qtype = DNSPacket::DNSType::A;
 
     DNSPacket packet;
     packet.setQR(DNSPacket::DNSQR::QUESTION);
+    query.qtype = DNSPacket::DNSType::A;
+    packet.addQuestion(query);
+    query.qtype = DNSPacket::DNSType::SRV;
     packet.addQuestion(query);
     send(packet.generateNetworkFormat(), MDNS_MULTICAST_EP);
 }
@@ -390,83 +661,201 @@ void SDServerClient::handleAResponse(const DNSPacket::ResourceRecord &response)
         return;
     }
 
-    auto serviceLabels = dns_format::domainToString(dns_format::withoutFirstLabel(response.name));
+    std::lock_guard<std::mutex> lock(instancesMutex);
+    auto &instance = instances[response.name];
+    instance.addr = response.getAddress();
+    instance.refreshAfter =
+        std::chrono::system_clock::now() + std::chrono::seconds(response.ttl / 2);
+    extendExpiration(instance, response.ttl);
+    setServiceAvailable(response.name, instance, std::chrono::seconds(response.ttl));
+}
 
-    auto addr = bitops::u32ToAddr(response.getAddress());
-    auto ttl = std::chrono::seconds(response.ttl);
+void SDServerClient::handleSRVResponse(const DNSPacket::ResourceRecord &response) {
+    if (!supportedService(response.name) || !isHostKnown(response.name)) {
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock(instancesMutex);
+    auto &instance = instances[response.name];
+    instance.port = response.getSRVPort();
+    extendExpiration(instance, response.ttl);
+    // SRV may come after A, peers which don't answer SRV are probed on default ports
+    if (instance.addr) {
+        setServiceAvailable(response.name, instance, std::chrono::seconds(response.ttl));
+    }
+}
+
+void SDServerClient::extendExpiration(Instance &instance, u32 ttl) {
+    instance.expiration =
+        std::max(instance.expiration, std::chrono::system_clock::now() + std::chrono::seconds(ttl));
+}
+
+void SDServerClient::setServiceAvailable(const std::vector<u8> &domain, const Instance &instance,
+                                         std::chrono::seconds ttl) {
+    auto serviceLabels = dns_format::domainToString(dns_format::withoutFirstLabel(domain));
+    auto addr = bitops::u32ToAddr(instance.addr);
 
     if (serviceLabels == TCP_SERVICE) {
-        latencyDatabase.setConnectionAvailable(LatencyDatabase::ProtocolType::TCP, addr, ttl);
+        latencyDatabase.setConnectionAvailable(
+            LatencyDatabase::ProtocolType::TCP, addr, ttl, instance.port);
     }
     if (serviceLabels == OPOZNIENIA_SERVICE) {
-        latencyDatabase.setConnectionAvailable(LatencyDatabase::ProtocolType::UDP, addr, ttl);
+        latencyDatabase.setConnectionAvailable(
+            LatencyDatabase::ProtocolType::UDP, addr, ttl, instance.port);
     }
 }
 
 void SDServerClient::send(const std::vector<u8> &bytes, endpoint_t dst,
-                          std::chrono::microseconds delay) {
-    if (delay == std::chrono::microseconds(0)) {
-        boost::system::error_code ec;
-        socketMutex.lock();
-        socket.send_to(
-            boost::asio::buffer(bytes), dst, boost::asio::ip::udp::socket::message_flags(), ec);
-        socketMutex.unlock();
-    } else {
-        std::thread delayThread([=]() {
-            std::this_thread::sleep_for(delay);
-            boost::system::error_code ec;
-            socketMutex.lock();
-            socket.send_to(
-                boost::asio::buffer(bytes), dst, boost::asio::ip::udp::socket::message_flags(), ec);
-            socketMutex.unlock();
-        });
-        delayThread.detach();
+                          std::chrono::milliseconds delay) {
+    if (delay == std::chrono::milliseconds(0)) {
+        sendNow(bytes, dst);
+        return;
     }
-}
 
-boost::asio::ip::address_v4 SDServerClient::getHostAddr(boost::asio::ip::address_v4 peer) const {
-    ifaddrs *addrs;
-    getifaddrs(&addrs);
-
-    uint32_t result = 0;
-    uint32_t peerAddr = bitops::addrToU32(peer);
-    for (ifaddrs *curIf = addrs; curIf; curIf = curIf->ifa_next) {
-        if (curIf->ifa_addr && curIf->ifa_addr->sa_family == AF_INET) {
-            std::uint32_t addr = bitops::ntoh(((sockaddr_in *)curIf->ifa_addr)->sin_addr.s_addr);
-            std::uint32_t netmask =
-                bitops::ntoh(((sockaddr_in *)curIf->ifa_netmask)->sin_addr.s_addr);
-            if ((netmask & addr) == (netmask & peerAddr)) {
-                result = addr;
-                break;
-            }
-        }
+    std::lock_guard<std::mutex> lock(delayedSendsMutex);
+    auto it = delayedSends.find(dst);
+    if (it != delayedSends.end() && aggregate(*it->second, bytes)) {
+        // leaves with answers already waiting, which is not later than delay
+        return;
     }
 
-    freeifaddrs(addrs);
-    return bitops::u32ToAddr(result);
+    auto delayed = std::make_shared<DelayedSend>(ioService, dst);
+    delayed->header.assign(bytes.begin(), bytes.begin() + DNS_HEADER_SIZE);
+    delayed->answers.emplace_back(bytes.begin() + DNS_HEADER_SIZE, bytes.end());
+    delayed->size = bytes.size();
+    delayed->timer.expires_from_now(delay);
+    delayed->timer.async_wait(boost::bind(
+        &SDServerClient::handleDelayedSend, this, delayed, boost::asio::placeholders::error));
+    // aggregate which was full is sent on its own
+    delayedSends[dst] = delayed;
 }
 
-void SDServerClient::addKnownHost(const std::vector<u8> &domain, u16 ttl) {
-    std::unique_lock<std::mutex>(knownHostNamesMutex);
-    auto hostName = dns_format::firstLabel(domain);
-    knownHostNames[hostName] = std::chrono::system_clock::now() + std::chrono::seconds(ttl);
+bool SDServerClient::aggregate(DelayedSend &delayed, const std::vector<u8> &bytes) {
+    // only responses with single answer and nothing else, as encoded by CachedResponse
+    if (!isSingleAnswer(bytes) || !isSingleAnswer(delayed.header) ||
+        !std::equal(bytes.begin(), bytes.begin() + 4, delayed.header.begin())) {
+        return false;
+    }
+
+    std::vector<u8> answer(bytes.begin() + DNS_HEADER_SIZE, bytes.end());
+    if (std::find(delayed.answers.begin(), delayed.answers.end(), answer) !=
+        delayed.answers.end()) {
+        // same answer to several queries is sent once
+        return true;
+    }
+    if (delayed.size + answer.size() > MAX_AGGREGATED_SIZE) {
+        return false;
+    }
+    delayed.size += answer.size();
+    delayed.answers.push_back(std::move(answer));
+    return true;
 }
 
-bool SDServerClient::isHostKnown(const std::vector<u8> &domain) {
-    std::unique_lock<std::mutex>(knownHostNamesMutex);
+void SDServerClient::handleDelayedSend(std::shared_ptr<DelayedSend> delayed,
+                                       const boost::system::error_code &error) {
+    delayedSendsMutex.lock();
+    auto it = delayedSends.find(delayed->dst);
+    if (it != delayedSends.end() && it->second == delayed) {
+        delayedSends.erase(it);
+    }
+    delayedSendsMutex.unlock();
 
-    auto hostname = dns_format::firstLabel(domain);
-    if (knownHostNames.find(hostname) == knownHostNames.end()) {
-        return false;
+    if (error) {
+        return;
     }
-    if (knownHostNames[hostname] < std::chrono::system_clock::now()) {
-        knownHostNames.erase(hostname);
+
+    std::vector<u8> packet = delayed->header;
+    packet.reserve(delayed->size);
+    if (delayed->answers.size() > 1) {
+        u16 answersCount = delayed->answers.size();
+        packet[6] = answersCount >> 8;
+        packet[7] = answersCount & 0xFF;
+    }
+    for (const auto &answer : delayed->answers) {
+        packet.insert(packet.end(), answer.begin(), answer.end());
     }
+    sendNow(packet, delayed->dst);
+}
+
+bool SDServerClient::isSingleAnswer(const std::vector<u8> &bytes) {
+    static const u8 counts[] = {0, 0, 0, 1, 0, 0, 0, 0};
+    return bytes.size() >= DNS_HEADER_SIZE &&
+           std::equal(counts, counts + sizeof(counts), bytes.begin() + 4);
+}
+
+void SDServerClient::sendNow(const std::vector<u8> &bytes, endpoint_t dst) {
+    boost::system::error_code ec;
+    socketMutex.lock();
+    socket.send_to(
+        boost::asio::buffer(bytes), dst, boost::asio::ip::udp::socket::message_flags(), ec);
+    socketMutex.unlock();
+}
+
+boost::asio::ip::address_v4 SDServerClient::getHostAddr(boost::asio::ip::address_v4 peer) const {
+    return bitops::u32ToAddr(interfaces.getLocalAddr(bitops::addrToU32(peer)));
+}
 
-    return knownHostNames.find(hostname) != knownHostNames.end();
+void SDServerClient::addKnownHost(const std::vector<u8> &domain, u32 ttl) {
+    std::lock_guard<std::mutex> lock(knownHostsMutex);
+    auto now = std::chrono::system_clock::now();
+    knownHosts.add(domain, now + std::chrono::seconds(ttl), now);
+}
+
+bool SDServerClient::isHostKnown(const std::vector<u8> &domain) {
+    std::lock_guard<std::mutex> lock(knownHostsMutex);
+    return knownHosts.contains(domain, std::chrono::system_clock::now());
 }
 
 bool SDServerClient::supportedService(const std::vector<u8> &domain) {
     auto servicesLabels = dns_format::domainToString(dns_format::withoutFirstLabel(domain));
     return servicesLabels == TCP_SERVICE || servicesLabels == OPOZNIENIA_SERVICE;
-}
\ No newline at end of file
+}
+
+SDServerClient::NameResponses::NameResponses() : instance(false) {
+}
+
+SDServerClient::CachedResponse::CachedResponse() : ttlOffset(0) {
+}
+
+SDServerClient::CachedResponse::CachedResponse(const DNSPacket::ResourceRecord &answer) {
+    DNSPacket response;
+    response.setQR(DNSPacket::DNSQR::RESPONSE);
+    response.addAnswer(answer);
+    packet = response.generateNetworkFormat();
+    // after header, name, type and class
+    ttlOffset = DNS_HEADER_SIZE + answer.name.size() + 4;
+}
+
+void SDServerClient::CachedResponse::setID(u16 id) {
+    packet[0] = id >> 8;
+    packet[1] = id & 0xFF;
+}
+
+void SDServerClient::CachedResponse::setTTL(u32 ttl) {
+    for (unsigned i = 0; i < sizeof(ttl); i++) {
+        packet[ttlOffset + i] = ttl >> (8 * (sizeof(ttl) - i - 1));
+    }
+}
+
+bool SDServerClient::CachedResponse::matches(const DNSPacket::ResourceRecord &rr) const {
+    auto bytes = rr.generateNetworkFormat();
+    std::size_t ttlPos = ttlOffset - DNS_HEADER_SIZE;
+    if (packet.size() != DNS_HEADER_SIZE + bytes.size() || !isSingleAnswer(packet)) {
+        return false;
+    }
+    auto answer = packet.begin() + DNS_HEADER_SIZE;
+    return std::equal(bytes.begin(), bytes.begin() + ttlPos, answer) &&
+           std::equal(bytes.begin() + ttlPos + 4, bytes.end(), answer + ttlPos + 4);
+}
+
+void SDServerClient::CachedResponse::addQuestion(const DNSPacket::Question &q) {
+    // only answer follows header, so QDCOUNT was 0
+    auto question = q.generateNetworkFormat();
+    packet.insert(packet.begin() + DNS_HEADER_SIZE, question.begin(), question.end());
+    packet[5] = 1;
+    ttlOffset += question.size();
+}
+
+SDServerClient::DelayedSend::DelayedSend(boost::asio::io_service &ioService, endpoint_t dst)
+    : timer(ioService), dst(dst), size(0) {
+}
@@ -3,24 +3,32 @@
 
 #include <boost/asio.hpp>
 #include <boost/array.hpp>
-#include <thread>
+#include <boost/asio/steady_timer.hpp>
+#include <atomic>
 #include <mutex>
 #include <map>
 #include <memory>
 
 #include "DNSPacket.h"
+#include "DNSPacketView.h"
+#include "InterfaceAddressTable.h"
+#include "KnownHostTable.h"
 #include "LatencyDatabase.h"
 #include "bitops.h"
 
 class SDServerClient {
 public:
-    SDServerClient(LatencyDatabase &LatencyDatabase);
+    // udpPort - advertised in SRV record of _opoznienia._udp instance
+    // receive, lookups and delayed sends are handled on ioService threads
+    SDServerClient(boost::asio::io_service &ioService, LatencyDatabase &LatencyDatabase,
+                   u16 udpPort);
     ~SDServerClient() = default;
     SDServerClient(const SDServerClient &) = delete;
     SDServerClient(SDServerClient &&) = delete;
     SDServerClient &operator=(const SDServerClient &) = delete;
     SDServerClient &operator=(SDServerClient &&) = delete;
 
+    // there is at most one pending receive, so received packets are handled one at a time
     void run(std::chrono::seconds lookupInterval, bool tcpAvailable);
     void stopServices();
 
@@ -31,40 +39,144 @@ private:
     static const u32 DEFAULT_TTL = 4500;
     static const std::string TCP_SERVICE;
     static const std::string OPOZNIENIA_SERVICE;
+    static const std::vector<std::string> lookedUpServices;
     static const endpoint_t MDNS_MULTICAST_EP;
 
     static const unsigned PTR_TIME_IDX = 0;
     static const unsigned A_TIME_IDX = 1;
-    std::unique_ptr<time_point_t> lastMutlicastResponses[2];
+    static const unsigned SRV_TIME_IDX = 2;
+    static const unsigned TXT_TIME_IDX = 3;
+    std::unique_ptr<time_point_t> lastMutlicastResponses[4];
     bool tcpAvailable;
+    u16 udpPort;
+    // used only by lookup handler, which never runs concurrently with itself
     std::string hostname;
-    bool hostnameEstablished;
+    // set by lookup handler once responses are prepared, read by receive handler
+    std::atomic<bool> hostnameEstablished;
 
-    boost::asio::io_service ioService;
+    boost::asio::io_service &ioService;
+    InterfaceAddressTable interfaces;
 
     boost::asio::ip::udp::socket socket;
     std::mutex socketMutex;
-    std::thread lookupThread;
-    std::thread receiveThread;
 
-    // host name i.e. first label of domain name
-    std::map<std::vector<u8>, time_point_t> knownHostNames;
-    std::mutex knownHostNamesMutex;
+    std::chrono::seconds lookupInterval;
+    boost::asio::steady_timer lookupTimer;
+    bool unicastResponseRequested;
+
+    // largest aggregated response, fits in ethernet frame
+    static const unsigned MAX_AGGREGATED_SIZE = 1472;
+
+    // answers to one destination, sent together when the earliest of them is due
+    struct DelayedSend {
+        DelayedSend(boost::asio::io_service &ioService, endpoint_t dst);
+
+        boost::asio::steady_timer timer;
+        endpoint_t dst;
+        // header of first response, answers count is set on send
+        std::vector<u8> header;
+        std::vector<std::vector<u8>> answers;
+        std::size_t size;
+    };
+    // at most one aggregate per destination accepts new answers
+    std::map<endpoint_t, std::shared_ptr<DelayedSend>> delayedSends;
+    std::mutex delayedSendsMutex;
+
+    // host names of other instances, expired ones are evicted every EVICTION_INTERVAL
+    static const std::chrono::seconds EVICTION_INTERVAL;
+    KnownHostTable knownHosts;
+    std::mutex knownHostsMutex;
+    boost::asio::steady_timer evictionTimer;
+
+    // address and port of service instance, 0 if not received yet
+    struct Instance {
+        u32 addr;
+        u16 port;
+        // A record is asked for again only after half of its TTL
+        time_point_t refreshAfter;
+        // when the last of its PTR, A and SRV records expires, then instance is evicted
+        time_point_t expiration;
+    };
+    // instance name i.e. full domain name
+    std::map<std::vector<u8>, Instance> instances;
+    std::mutex instancesMutex;
+
     std::vector<u8> buffer;
-    DNSPacket queryPTRPacket;
+
+    // PTR records of other instances, listed as known answers in our queries (RFC 6762 7.1)
+    struct KnownAnswer {
+        time_point_t expiration;
+        u32 ttl;
+    };
+    // by instance name i.e. full domain name
+    std::map<std::vector<u8>, KnownAnswer> knownAnswers;
+    // when query of another host with the same question as ours was seen (RFC 6762 7.3),
+    // indexed as lookedUpServices
+    time_point_t duplicateQuestions[2];
+    time_point_t lastLookup;
+    std::mutex knownAnswersMutex;
+
+    static const unsigned DNS_HEADER_SIZE = 12;
+
+    // encoded response with single answer, ID 0 and DEFAULT_TTL, as sent via multicast
+    struct CachedResponse {
+        CachedResponse();
+        CachedResponse(const DNSPacket::ResourceRecord &answer);
+
+        void setID(u16 id);
+        void setTTL(u32 ttl);
+        // question is placed before answer, as legacy unicast responses repeat it
+        void addQuestion(const DNSPacket::Question &q);
+        // same record as answer, TTL aside
+        bool matches(const DNSPacket::ResourceRecord &rr) const;
+
+        std::vector<u8> packet;
+        std::size_t ttlOffset;
+    };
+
+    // responses on one name, null if name has no record of that type
+    struct NameResponses {
+        NameResponses();
+
+        std::unique_ptr<CachedResponse> ptr;
+        std::unique_ptr<CachedResponse> srv;
+        std::unique_ptr<CachedResponse> txt;
+        // A of instance, by local address of interface, filled on first query from it
+        std::map<u32, CachedResponse> a;
+        bool instance;
+    };
+    // by name, rebuilt when hostname changes
+    std::map<std::vector<u8>, NameResponses> responses;
+    std::mutex responsesMutex;
 
     LatencyDatabase &latencyDatabase;
 
     void prepareSocket();
     void prepareHostname();
-    void prepareQueryPacket(bool unicastResponseRequested);
-
-    void multicastLookupThreadFunc(std::chrono::seconds lookupInterval);
-    void receiveThreadFunc();
+    // PTR query for services, split into several packets with TC if known answers don't fit
+    void sendLookupQuery(bool unicastResponseRequested);
+    void addKnownAnswer(const std::vector<u8> &instance, u32 ttl);
+    // notes questions which make our next query unnecessary
+    void handleDuplicateQuestions(const DNSPacket &packet);
+    // true if query lists our answer with at least half of its TTL remaining
+    bool isKnownAnswer(const DNSPacket &packet, const DNSPacket::Question &q,
+                       endpoint_t senderEndpoint);
+
+    void asyncLookup();
+    void handleLookup(const boost::system::error_code &error);
+    void asyncEviction();
+    void handleEviction(const boost::system::error_code &error);
+    void asyncReceive();
+    void handleReceive(const boost::system::error_code &error);
 
     void receiveMessage(endpoint_t senderEndpoint, endpoint_t msgDestination,
                         std::size_t bytesToRead);
-    bool ignorePacket(const DNSPacket &packet, endpoint_t senderEndpoint) const;
+    bool ignorePacket(const DNSPacketView &packet, endpoint_t senderEndpoint) const;
+    // cheap checks on view, before packet is copied
+    bool hasSupportedQuestion(const DNSPacketView &packet) const;
+    bool hasSupportedAnswer(const DNSPacketView &packet) const;
+    // name is service or its instance
+    static bool isServiceName(const DNSPacketView::Name &name);
     bool ignoreQuestion(const DNSPacket::Question &q) const;
 
     void handleQuestions(const DNSPacket &packet, endpoint_t senderEndpoint,
@@ -74,25 +186,44 @@ private:
     void handleUnicastQuery(const DNSPacket::Question &q, endpoint_t senderEndpoint);
     void responseViaMulticast(const DNSPacket::Question &q, endpoint_t senderEndpoint);
 
-    DNSPacket::ResourceRecord generatePTRAnswer(const DNSPacket::Question &q) const;
-    DNSPacket::ResourceRecord generateAAnswer(const DNSPacket::Question &q,
-                                              endpoint_t senderEndpoint) const;
+    // encodes responses for current hostname, called whenever it changes
+    void prepareResponses();
+    // A responses are encoded again on next queries, called when interface addresses change
+    void forgetAddressResponses();
+    // copy of cached response, false if question is not about us
+    bool getResponse(const DNSPacket::Question &q, endpoint_t senderEndpoint,
+                     CachedResponse &response);
     DNSPacket::ResourceRecord generatePlainAnswer() const;
+    static unsigned timeIndex(u16 qtype);
 
     void handleResponses(const DNSPacket &packet, endpoint_t senderEndpoint);
     void handlePTRResponse(const DNSPacket::ResourceRecord &response);
     void handleAResponse(const DNSPacket::ResourceRecord &response);
-    void sendAQuery(const std::vector<u8> &domain);
-
+    void handleSRVResponse(const DNSPacket::ResourceRecord &response);
+    void setServiceAvailable(const std::vector<u8> &domain, const Instance &instance,
+                             std::chrono::seconds ttl);
+    // instancesMutex has to be locked
+    static void extendExpiration(Instance &instance, u32 ttl);
+    // A and SRV of instance
+    void sendInstanceQuery(const std::vector<u8> &domain);
+
+    // delayed responses to the same destination are aggregated into one packet
     void send(const std::vector<u8> &bytes, endpoint_t dst,
-              std::chrono::microseconds delay = std::chrono::microseconds(0));
-    std::chrono::microseconds delayForPTRResponse() const;
+              std::chrono::milliseconds delay = std::chrono::milliseconds(0));
+    void sendNow(const std::vector<u8> &bytes, endpoint_t dst);
+    // true if answers of response were added to pending aggregate
+    bool aggregate(DelayedSend &delayed, const std::vector<u8> &bytes);
+    // header counts only one answer
+    static bool isSingleAnswer(const std::vector<u8> &bytes);
+    void handleDelayedSend(std::shared_ptr<DelayedSend> delayed,
+                           const boost::system::error_code &error);
+    std::chrono::milliseconds delayForPTRResponse() const;
 
     boost::asio::ip::address_v4 getHostAddr(boost::asio::ip::address_v4 peer) const;
 
     // arg - at least first label of domain
     bool isHostKnown(const std::vector<u8> &domain);
-    void addKnownHost(const std::vector<u8> &domain, u16 ttl);
+    void addKnownHost(const std::vector<u8> &domain, u32 ttl);
 
     // arg - full domain name
     bool supportedService(const std::vector<u8> &domain);
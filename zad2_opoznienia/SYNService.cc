@@ -0,0 +1,252 @@
+#include <cstring>
+#include <cstdlib>
+#include <iostream>
+#include <unistd.h>
+#include <boost/bind.hpp>
+
+#include "SYNService.h"
+#include "settings.h"
+
+SYNService::SYNService(boost::asio::io_service &ioServiceForListening,
+                       LatencyDatabase &latencyDatabase)
+    : listening(false),
+      localPort(0),
+      nextSeqNumber(rand()),
+      requests(PENDING_PROBES_BITS),
+      buffer(BUFFER_SIZE),
+      latencyDatabase(latencyDatabase),
+      socket(ioServiceForListening),
+      portReservation(ioServiceForListening) {
+    // ports, sequence number and checksum are filled in on send
+    static const u8 synTemplate[SYN_SIZE] = {0, 0, 0, 0,  // ports
+                                             0, 0, 0, 0,  // sequence number
+                                             0, 0, 0, 0,  // acknowledgment number
+                                             (SYN_SIZE / 4) << 4, FLAG_SYN,  // data offset, flags
+                                             0xFF, 0xFF,  // window
+                                             0, 0, 0, 0,  // checksum, urgent pointer
+                                             2, 4, 0x05, 0xB4};  // MSS 1460
+    memcpy(synPacket, synTemplate, SYN_SIZE);
+}
+
+void SYNService::startListening() {
+    using namespace boost::asio;
+    if (!listening) {
+        portReservation.open(ip::tcp::v4());
+        portReservation.bind(ip::tcp::endpoint(ip::tcp::v4(), 0));
+        localPort = portReservation.local_endpoint().port();
+
+        socket.open(generic::raw_protocol(AF_INET, IPPROTO_TCP));
+        asyncReceive();
+        listening = true;
+    } else {
+        throw std::logic_error("already running");
+    }
+}
+
+void SYNService::asyncReceive() {
+    socket.async_wait(
+        boost::asio::generic::raw_protocol::socket::wait_read,
+        boost::bind(&SYNService::handleMessages, this, boost::asio::placeholders::error));
+}
+
+void SYNService::handleMessages(const boost::system::error_code &error) {
+    if (!error) {
+        while (true) {
+            // raw socket receives copy of every TCP segment of host
+            ssize_t recLen =
+                recv(socket.native_handle(), buffer.data(), buffer.size(), MSG_DONTWAIT);
+            if (recLen == -1) {
+                break;
+            }
+            handleMessage(recLen, getMonotonicTime());
+        }
+        // probes without answer are reported as lost also between rounds
+        historyMutex.lock();
+        refreshHistory();
+        historyMutex.unlock();
+    }
+    asyncReceive();
+}
+
+void SYNService::handleMessage(std::size_t bytesCount, u64 receiveTime) {
+    try {
+        raw_data_it it = buffer.begin();
+        raw_data_it end = buffer.begin() + bytesCount;
+
+        unsigned ihl = (bitops::getU8(it, end) & 0x0F) * 4;
+        if (ihl < 20 || bytesCount < ihl + 20) {
+            return;
+        }
+        it = buffer.begin() + 12;
+        u32 peer = bitops::getU32(it, end);
+
+        it = buffer.begin() + ihl;
+        // hosts are probed on different ports, so answer is matched by peer and ack only
+        (void)bitops::getU16(it, end);
+        u16 destinationPort = bitops::getU16(it, end);
+        (void)bitops::getU32(it, end);
+        u32 ackNumber = bitops::getU32(it, end);
+        (void)bitops::getU8(it, end);
+        u8 flags = bitops::getU8(it, end);
+
+        bool synAck = (flags & (FLAG_SYN | FLAG_ACK)) == (FLAG_SYN | FLAG_ACK);
+        bool reset = (flags & (FLAG_RST | FLAG_ACK)) == (FLAG_RST | FLAG_ACK);
+        if (destinationPort != localPort || !(synAck || reset)) {
+            return;
+        }
+
+        // RST means closed port, but it is answer all the same
+        PendingProbeTable::Probe probe;
+        historyMutex.lock();
+        bool matched = requests.remove(peer, ackNumber - 1, probe);
+        historyMutex.unlock();
+
+        if (matched && receiveTime >= probe.sendTime) {
+            latencyDatabase.addLatency(LatencyDatabase::ProtocolType::TCP,
+                                       bitops::u32ToAddr(peer),
+                                       std::chrono::microseconds(receiveTime - probe.sendTime));
+        }
+    } catch (UnknownFormatException &) {
+    }
+}
+
+void SYNService::measureLatency(const std::vector<boost::asio::ip::tcp::endpoint> &targets) {
+    historyMutex.lock();
+    refreshHistory();
+    historyMutex.unlock();
+    refreshSourceAddrs();
+
+    for (const auto &target : targets) {
+        sendSYN(target);
+    }
+}
+
+void SYNService::sendSYN(const boost::asio::ip::tcp::endpoint &target) {
+    u16 port = target.port() ? target.port() : (u16)TCP_PORT;
+
+    u32 destination = bitops::addrToU32(target.address().to_v4());
+    u32 source;
+    if (!getSourceAddr(destination, source)) {
+        return;
+    }
+
+    u32 seqNumber = nextSeqNumber++;
+    u16 netLocalPort = bitops::hton(localPort);
+    u16 netPort = bitops::hton(port);
+    u32 netSeqNumber = bitops::hton(seqNumber);
+    memcpy(synPacket, &netLocalPort, sizeof(netLocalPort));
+    memcpy(synPacket + 2, &netPort, sizeof(netPort));
+    memcpy(synPacket + 4, &netSeqNumber, sizeof(netSeqNumber));
+    memset(synPacket + 16, 0, 2);
+    u16 checksum = bitops::hton(calcChecksum(source, destination, synPacket, SYN_SIZE));
+    memcpy(synPacket + 16, &checksum, sizeof(checksum));
+
+    // registered before sending, so that answer can't arrive earlier
+    historyMutex.lock();
+    requests.insert(PendingProbeTable::Probe{destination, seqNumber, getMonotonicTime()},
+                    [this](const PendingProbeTable::Probe &p) { reportLoss(p); });
+    historyMutex.unlock();
+
+    sockaddr_in destinationAddr;
+    memset(&destinationAddr, 0, sizeof(destinationAddr));
+    destinationAddr.sin_family = AF_INET;
+    destinationAddr.sin_addr.s_addr = bitops::hton(destination);
+    if (sendto(socket.native_handle(),
+               synPacket,
+               SYN_SIZE,
+               0,
+               (sockaddr *)&destinationAddr,
+               sizeof(destinationAddr)) == -1) {
+        PendingProbeTable::Probe probe;
+        historyMutex.lock();
+        requests.remove(destination, seqNumber, probe);
+        historyMutex.unlock();
+    }
+}
+
+// checksum covers pseudo-header, so source address chosen by routing is needed
+// connecting UDP socket asks kernel for it without sending anything
+bool SYNService::getSourceAddr(u32 destination, u32 &source) {
+    u64 curTime = getMonotonicTime();
+    auto it = sourceAddrs.find(destination);
+    if (it != sourceAddrs.end()) {
+        it->second.lastUsed = curTime;
+        source = it->second.addr;
+        return true;
+    }
+
+    int fd = ::socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd == -1) {
+        std::cerr << __func__ << ": " << strerror(errno) << "\n";
+        return false;
+    }
+
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = bitops::hton((u16)TCP_PORT);
+    addr.sin_addr.s_addr = bitops::hton(destination);
+    socklen_t addrLen = sizeof(addr);
+    bool ok = connect(fd, (sockaddr *)&addr, sizeof(addr)) == 0 &&
+              getsockname(fd, (sockaddr *)&addr, &addrLen) == 0;
+    close(fd);
+    if (!ok) {
+        return false;
+    }
+
+    source = bitops::ntoh((u32)addr.sin_addr.s_addr);
+    sourceAddrs[destination] = SourceAddr{source, curTime};
+    return true;
+}
+
+void SYNService::refreshSourceAddrs() {
+    static const u64 maxLatency = std::chrono::duration_cast<std::chrono::microseconds>(
+                                      std::chrono::seconds(MAX_LATENCY_SECS))
+                                      .count();
+
+    u64 curTime = getMonotonicTime();
+    for (auto it = sourceAddrs.begin(); it != sourceAddrs.end();) {
+        if (curTime - it->second.lastUsed > maxLatency) {
+            it = sourceAddrs.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+void SYNService::refreshHistory() {
+    static const u64 maxLatency = std::chrono::duration_cast<std::chrono::microseconds>(
+                                      std::chrono::seconds(MAX_LATENCY_SECS))
+                                      .count();
+    // bounded, so that one call doesn't stall sending
+    static const unsigned maxExpiredCount = 2 * UDP_BATCH_SIZE;
+
+    requests.expire(getMonotonicTime() - maxLatency,
+                    maxExpiredCount,
+                    [this](const PendingProbeTable::Probe &p) { reportLoss(p); });
+}
+
+void SYNService::reportLoss(const PendingProbeTable::Probe &probe) {
+    latencyDatabase.addLoss(LatencyDatabase::ProtocolType::TCP, bitops::u32ToAddr(probe.peer));
+}
+
+u16 SYNService::calcChecksum(u32 source, u32 destination, const u8 *segment, unsigned size) {
+    u32 sum = (source >> 16) + (source & 0xFFFF) + (destination >> 16) + (destination & 0xFFFF) +
+              IPPROTO_TCP + size;
+    for (unsigned i = 0; i + 1 < size; i += 2) {
+        sum += bitops::merge(segment[i], segment[i + 1]);
+    }
+    if (size % 2) {
+        sum += bitops::merge(segment[size - 1], (u8)0);
+    }
+
+    sum = (sum >> 16) + (sum & 0xFFFF);
+    sum += (sum >> 16);
+    return ~sum;
+}
+
+u64 SYNService::getMonotonicTime() {
+    auto curTimePoint = std::chrono::steady_clock::now();
+    return std::chrono::duration_cast<std::chrono::microseconds>(curTimePoint.time_since_epoch())
+        .count();
+}
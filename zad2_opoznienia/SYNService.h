@@ -0,0 +1,79 @@
+#ifndef SYN_SERVICE__H
+#define SYN_SERVICE__H
+
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <boost/asio.hpp>
+
+#include "LatencyDatabase.h"
+#include "PendingProbeTable.h"
+#include "bitops.h"
+
+// Half-open TCP probing: sends crafted SYNs from one raw socket and measures time
+// to SYN-ACK or RST. Handshake is never completed - kernel answers SYN-ACK with RST,
+// as no socket is connected from our port. Requires CAP_NET_RAW.
+// Source port is reserved by bound TCP socket, so no connection of host uses it.
+class SYNService {
+public:
+    SYNService(boost::asio::io_service &ioServiceForListening, LatencyDatabase &latencyDatabase);
+    SYNService(const SYNService &) = delete;
+    SYNService(SYNService &&) = delete;
+    SYNService &operator=(const SYNService &) = delete;
+    SYNService &operator=(SYNService &&) = delete;
+
+    // receive asynchronously, handlers on ioServiceForListening threads
+    // there is at most one pending receive, so handlers never run concurrently
+    void startListening();
+
+    // send SYNs synchronously on caller thread
+    // calls from several threads at the same time are prohibited
+    // targets with port 0 are probed on TCP_PORT
+    void measureLatency(const std::vector<boost::asio::ip::tcp::endpoint> &targets);
+
+private:
+    // TCP header with MSS option
+    static const unsigned SYN_SIZE = 24;
+    static const u8 FLAG_RST = 0x04;
+    static const u8 FLAG_SYN = 0x02;
+    static const u8 FLAG_ACK = 0x10;
+
+    bool listening;
+    u16 localPort;
+    // sequence number of next SYN, probes are matched by acknowledged one
+    u32 nextSeqNumber;
+    u8 synPacket[SYN_SIZE];
+    // source address chosen by routing and time of last probe using it
+    struct SourceAddr {
+        u32 addr;
+        u64 lastUsed;
+    };
+    // destination -> source address, entries of hosts not probed for MAX_LATENCY_SECS
+    // are dropped, so that forgotten hosts don't pile up
+    std::map<u32, SourceAddr> sourceAddrs;
+
+    PendingProbeTable requests;
+    std::mutex historyMutex;
+
+    std::vector<u8> buffer;
+    LatencyDatabase &latencyDatabase;
+
+    boost::asio::generic::raw_protocol::socket socket;
+    boost::asio::ip::tcp::socket portReservation;
+
+    void asyncReceive();
+    void handleMessages(const boost::system::error_code &error);
+    void handleMessage(std::size_t bytesCount, u64 receiveTime);
+
+    void sendSYN(const boost::asio::ip::tcp::endpoint &target);
+    bool getSourceAddr(u32 destination, u32 &source);
+    void refreshSourceAddrs();
+    void refreshHistory();
+    // historyMutex has to be locked
+    void reportLoss(const PendingProbeTable::Probe &probe);
+
+    static u16 calcChecksum(u32 source, u32 destination, const u8 *segment, unsigned size);
+    static u64 getMonotonicTime();
+};
+
+#endif
@@ -1,59 +1,255 @@
+#include <cstring>
+#include <iostream>
 #include <boost/bind.hpp>
 
 #include "TCPService.h"
 #include "settings.h"
 
-TCPService::TCPService(boost::asio::io_service &ioService, LatencyDatabase &latencyDatabase)
-    : ioService(ioService), latencyDatabase(latencyDatabase) {
+TCPService::TCPService(boost::asio::io_service &ioService, LatencyDatabase &latencyDatabase,
+                       Mode mode, unsigned maxConnects)
+    : mode(mode),
+      maxConnects(maxConnects),
+      connectsCount(0),
+      ioService(ioService),
+      strand(ioService),
+      latencyDatabase(latencyDatabase) {
+    if (mode == Mode::SYN) {
+        synService.reset(new SYNService(ioService, latencyDatabase));
+    }
 }
 
-void TCPService::measureLatency(const std::vector<boost::asio::ip::address_v4> &addrs) {
-    refreshHistory();
-    for (auto addr : addrs) {
-        asyncConnect(addr);
+void TCPService::startListening() {
+    if (synService) {
+        synService->startListening();
     }
 }
 
-void TCPService::asyncConnect(boost::asio::ip::address_v4 addr) {
-    static const u16 port = TCP_PORT;
+void TCPService::measureLatency(const std::vector<boost::asio::ip::tcp::endpoint> &targets) {
+    if (synService) {
+        synService->measureLatency(targets);
+        return;
+    }
+    strand.dispatch(boost::bind(&TCPService::startConnects, this, targets));
+}
 
-    auto socket = std::make_shared<socket_t>(ioService);
+void TCPService::forgetHosts(const std::vector<boost::asio::ip::address_v4> &addrs) {
+    if (mode == Mode::KEEP_ALIVE) {
+        strand.dispatch(boost::bind(&TCPService::closeConnections, this, addrs));
+    }
+}
 
-    auto curTime = std::chrono::system_clock::now();
-    history.push(std::make_pair(socket, curTime));
+// runs on strand
+void TCPService::closeConnections(const std::vector<boost::asio::ip::address_v4> &addrs) {
+    for (auto addr : addrs) {
+        auto it = connections.find(bitops::addrToU32(addr));
+        if (it == connections.end()) {
+            continue;
+        }
+        // pending read is cancelled and its handler finds connection already erased
+        boost::system::error_code ec;
+        it->second->socket->close(ec);
+        connections.erase(it);
+    }
+    startWaitingConnects();
+}
 
-    socket->async_connect(boost::asio::ip::tcp::endpoint(addr, port),
-                          boost::bind(&TCPService::handleConnect,
-                                      this,
-                                      socket,
-                                      curTime,
-                                      addr,
-                                      boost::asio::placeholders::error));
+// runs on strand
+void TCPService::startConnects(const std::vector<boost::asio::ip::tcp::endpoint> &targets) {
+    for (const auto &target : targets) {
+        auto addr = target.address().to_v4();
+        auto it = connections.find(bitops::addrToU32(addr));
+        if (it != connections.end()) {
+            if (sampleConnection(*it->second, addr)) {
+                continue;
+            }
+            // pending read is cancelled and its handler finds connection already erased
+            boost::system::error_code ec;
+            it->second->socket->close(ec);
+            connections.erase(it);
+        }
+        if (pendingAddrs.insert(bitops::addrToU32(addr)).second) {
+            waitingConnects.push_back(target);
+        }
+    }
+    startWaitingConnects();
 }
 
-void TCPService::refreshHistory() {
+// runs on strand
+void TCPService::startWaitingConnects() {
+    while (!waitingConnects.empty() && canStartConnect()) {
+        asyncConnect(waitingConnects.front());
+        waitingConnects.pop_front();
+    }
+}
+
+// runs on strand
+bool TCPService::canStartConnect() const {
+    return !maxConnects || connectsCount + connections.size() < maxConnects;
+}
+
+void TCPService::asyncConnect(const boost::asio::ip::tcp::endpoint &target) {
     static const std::chrono::seconds maxLatency(MAX_LATENCY_SECS);
-    auto curTime = std::chrono::system_clock::now();
 
-    while (!history.empty() && curTime - maxLatency > history.front().second) {
-        auto socket = history.front().first.lock();
-        if (socket) {
-            socket->cancel();
-        }
-        history.pop();
+    auto connect = std::make_shared<PendingConnect>(ioService, target.address().to_v4());
+    u16 port = target.port() ? target.port() : (u16)TCP_PORT;
+    connectsCount++;
+
+    connect->deadline.expires_from_now(maxLatency);
+    connect->deadline.async_wait(strand.wrap(boost::bind(
+        &TCPService::handleDeadline, this, connect, boost::asio::placeholders::error)));
+
+    connect->sendTime = std::chrono::steady_clock::now();
+    connect->socket->async_connect(
+        boost::asio::ip::tcp::endpoint(connect->addr, port),
+        strand.wrap(boost::bind(
+            &TCPService::handleConnect, this, connect, boost::asio::placeholders::error)));
+}
+
+void TCPService::handleDeadline(std::shared_ptr<PendingConnect> connect,
+                                const boost::system::error_code &error) {
+    if (error || connect->finished) {
+        return;
     }
+    // connect handler is called with operation_aborted and frees the slot
+    connect->timedOut = true;
+    boost::system::error_code ec;
+    connect->socket->close(ec);
+    latencyDatabase.addLoss(LatencyDatabase::ProtocolType::TCP, connect->addr);
 }
 
-void TCPService::handleConnect(std::shared_ptr<socket_t> socket,
-                               std::chrono::system_clock::time_point sendTime,
-                               boost::asio::ip::address_v4 remoteAddr,
+void TCPService::handleConnect(std::shared_ptr<PendingConnect> connect,
                                const boost::system::error_code &error) {
+    connect->finished = true;
+    connect->deadline.cancel();
+    connectsCount--;
+    pendingAddrs.erase(bitops::addrToU32(connect->addr));
+    // socket of connection to be kept still takes its slot
+    bool mayKeep = mode == Mode::KEEP_ALIVE && !error && !connect->timedOut;
+    if (!mayKeep) {
+        startWaitingConnects();
+    }
+
+    if (connect->timedOut) {
+        // completed after deadline, already counted as loss
+        return;
+    }
     if (error) {
+        // refused connection was answered, timed out one was counted by handleDeadline
+        if (error != boost::asio::error::connection_refused &&
+            error != boost::asio::error::operation_aborted) {
+            latencyDatabase.addLoss(LatencyDatabase::ProtocolType::TCP, connect->addr);
+        }
         return;
     }
 
-    auto curTime = std::chrono::system_clock::now();
+    auto curTime = std::chrono::steady_clock::now();
     LatencyDatabase::latency_t latency =
-        std::chrono::duration_cast<std::chrono::microseconds>(curTime - sendTime);
-    latencyDatabase.addLatency(LatencyDatabase::ProtocolType::TCP, remoteAddr, latency);
-}
\ No newline at end of file
+        std::chrono::duration_cast<std::chrono::microseconds>(curTime - connect->sendTime);
+
+    tcp_info info;
+    u32 rtt = 0;
+    if (mode != Mode::CONNECT && getTCPInfo(*connect->socket, info)) {
+        // the only RTT sample of fresh connection is the one of handshake
+        rtt = info.tcpi_rtt;
+        latency = std::chrono::microseconds(rtt);
+    }
+    latencyDatabase.addLatency(LatencyDatabase::ProtocolType::TCP, connect->addr, latency);
+
+    if (mayKeep) {
+        keepConnection(connect->socket, connect->addr, rtt);
+        startWaitingConnects();
+    }
+}
+
+void TCPService::keepConnection(std::shared_ptr<socket_t> socket,
+                                boost::asio::ip::address_v4 remoteAddr, u32 rtt) {
+    if (maxConnects && connections.size() >= maxConnects / 2) {
+        // host connects again in next rounds
+        boost::system::error_code ec;
+        socket->close(ec);
+        return;
+    }
+
+    // idle connection is probed every second, dead one is closed after MAX_LATENCY_SECS
+    int keepAlive = 1;
+    int idle = 1;
+    int interval = 1;
+    int count = MAX_LATENCY_SECS;
+    int fd = socket->native_handle();
+    if (setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &keepAlive, sizeof(keepAlive)) != 0 ||
+        setsockopt(fd, IPPROTO_TCP, TCP_KEEPIDLE, &idle, sizeof(idle)) != 0 ||
+        setsockopt(fd, IPPROTO_TCP, TCP_KEEPINTVL, &interval, sizeof(interval)) != 0 ||
+        setsockopt(fd, IPPROTO_TCP, TCP_KEEPCNT, &count, sizeof(count)) != 0) {
+        std::cerr << __func__ << ": " << strerror(errno) << "\n";
+        return;
+    }
+
+    auto connection = std::make_shared<Connection>();
+    connection->socket = socket;
+    connection->lastRTT = rtt;
+    connections[bitops::addrToU32(remoteAddr)] = connection;
+    asyncRead(connection, remoteAddr);
+}
+
+// runs on strand
+bool TCPService::sampleConnection(Connection &connection, boost::asio::ip::address_v4 remoteAddr) {
+    tcp_info info;
+    if (!getTCPInfo(*connection.socket, info)) {
+        return false;
+    }
+
+    // srtt moves only when ACK covers data in flight, unchanged one would repeat old sample
+    if (info.tcpi_rtt == connection.lastRTT) {
+        return false;
+    }
+    connection.lastRTT = info.tcpi_rtt;
+    latencyDatabase.addLatency(LatencyDatabase::ProtocolType::TCP,
+                               remoteAddr,
+                               std::chrono::microseconds(info.tcpi_rtt));
+    return true;
+}
+
+void TCPService::asyncRead(std::shared_ptr<Connection> connection,
+                           boost::asio::ip::address_v4 remoteAddr) {
+    connection->socket->async_read_some(
+        boost::asio::buffer(connection->buffer),
+        strand.wrap(boost::bind(&TCPService::handleRead,
+                                this,
+                                connection,
+                                remoteAddr,
+                                boost::asio::placeholders::error)));
+}
+
+void TCPService::handleRead(std::shared_ptr<Connection> connection,
+                            boost::asio::ip::address_v4 remoteAddr,
+                            const boost::system::error_code &error) {
+    if (!error) {
+        asyncRead(connection, remoteAddr);
+        return;
+    }
+
+    // closed by peer or by failed keep-alive probes, next round connects again
+    if (error == boost::asio::error::timed_out) {
+        latencyDatabase.addLoss(LatencyDatabase::ProtocolType::TCP, remoteAddr);
+    }
+    auto it = connections.find(bitops::addrToU32(remoteAddr));
+    if (it != connections.end() && it->second == connection) {
+        connections.erase(it);
+        startWaitingConnects();
+    }
+}
+
+bool TCPService::getTCPInfo(socket_t &socket, tcp_info &info) {
+    socklen_t length = sizeof(info);
+    memset(&info, 0, sizeof(info));
+    return getsockopt(socket.native_handle(), IPPROTO_TCP, TCP_INFO, &info, &length) == 0;
+}
+
+TCPService::PendingConnect::PendingConnect(boost::asio::io_service &ioService,
+                                           boost::asio::ip::address_v4 addr)
+    : socket(std::make_shared<socket_t>(ioService)),
+      deadline(ioService),
+      addr(addr),
+      finished(false),
+      timedOut(false) {
+}
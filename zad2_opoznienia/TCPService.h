@@ -1,40 +1,114 @@
 #ifndef TCP_SERVICE__H
 #define TCP_SERVICE__H
 
+#include <array>
 #include <chrono>
+#include <deque>
 #include <map>
-#include <queue>
+#include <set>
+#include <netinet/tcp.h>
 #include <boost/asio.hpp>
+#include <boost/asio/steady_timer.hpp>
 
 #include "LatencyDatabase.h"
+#include "SYNService.h"
 #include "bitops.h"
+#include "settings.h"
 
 class TCPService {
 public:
-    TCPService(boost::asio::io_service &ioService, LatencyDatabase &lb);
+    // CONNECT - latency is time of connect() measured in userspace
+    // KERNEL_RTT - latency is RTT of SYN/SYN-ACK taken from TCP_INFO of connected socket
+    // KEEP_ALIVE - as KERNEL_RTT, but connections are kept open with SO_KEEPALIVE,
+    //     and next rounds record kernel's smoothed RTT if it changed since last record,
+    //     i.e. when ACK of data gave kernel new sample; keep-alive ACKs don't, so idle
+    //     connection without new sample is closed and connected again, whose handshake
+    //     gives the sample of the round
+    // SYN - half-open probes sent by SYNService, no connections, requires CAP_NET_RAW
+    enum class Mode { CONNECT, KERNEL_RTT, KEEP_ALIVE, SYN };
+
+    // maxConnects - sockets open at the same time, connects in progress and kept connections,
+    //     others wait in queue, 0 means no limit
+    //     kept connections take at most half of them, so that connects always have room
+    TCPService(boost::asio::io_service &ioService, LatencyDatabase &lb,
+               Mode mode = Mode::CONNECT, unsigned maxConnects = 0);
     TCPService() = default;
     TCPService(const TCPService &) = delete;
     TCPService(TCPService &&) = delete;
     TCPService &operator=(const TCPService &) = delete;
     TCPService &operator=(TCPService &&) = delete;
 
+    // needed only in SYN mode
+    void startListening();
+
+    // connects are started and completed on strand, so that io_service may be run by many threads
+    // each connect is cancelled after MAX_LATENCY_SECS
+    // host with connect still queued or in progress is skipped
+    // targets with port 0 are connected on TCP_PORT
     // calls from several threads at the same time are prohibited
-    void measureLatency(const std::vector<boost::asio::ip::address_v4> &addrs);
+    void measureLatency(const std::vector<boost::asio::ip::tcp::endpoint> &targets);
+
+    // closes kept connections of hosts whose TCP service is no longer available
+    void forgetHosts(const std::vector<boost::asio::ip::address_v4> &addrs);
 
 private:
     using socket_t = boost::asio::ip::tcp::socket;
 
-    std::queue<std::pair<std::weak_ptr<socket_t>, std::chrono::system_clock::time_point>> history;
+    struct PendingConnect {
+        PendingConnect(boost::asio::io_service &ioService, boost::asio::ip::address_v4 addr);
+
+        std::shared_ptr<socket_t> socket;
+        boost::asio::steady_timer deadline;
+        std::chrono::steady_clock::time_point sendTime;
+        boost::asio::ip::address_v4 addr;
+        bool finished;
+        // loss was recorded by handleDeadline, connect may still complete afterwards
+        bool timedOut;
+    };
+
+    struct Connection {
+        std::shared_ptr<socket_t> socket;
+        // tcpi_rtt of last recorded sample
+        u32 lastRTT;
+        // data sent by server is read and dropped
+        std::array<u8, SMALL_BUFFER_SIZE> buffer;
+    };
+
+    Mode mode;
+    unsigned maxConnects;
+
+    // guarded by strand
+    unsigned connectsCount;
+    std::deque<boost::asio::ip::tcp::endpoint> waitingConnects;
+    // queued or in progress
+    std::set<u32> pendingAddrs;
+    // KEEP_ALIVE
+    std::map<u32, std::shared_ptr<Connection>> connections;
+    // SYN
+    std::unique_ptr<SYNService> synService;
 
     boost::asio::io_service &ioService;
+    boost::asio::io_service::strand strand;
     LatencyDatabase &latencyDatabase;
 
-    void refreshHistory();
-    void asyncConnect(boost::asio::ip::address_v4 addr);
-    void handleConnect(std::shared_ptr<socket_t> socket,
-                       std::chrono::system_clock::time_point sendTime,
-                       boost::asio::ip::address_v4 remoteAddr,
+    void startConnects(const std::vector<boost::asio::ip::tcp::endpoint> &targets);
+    void closeConnections(const std::vector<boost::asio::ip::address_v4> &addrs);
+    void startWaitingConnects();
+    bool canStartConnect() const;
+    void asyncConnect(const boost::asio::ip::tcp::endpoint &target);
+    void handleConnect(std::shared_ptr<PendingConnect> connect,
                        const boost::system::error_code &error);
+    void handleDeadline(std::shared_ptr<PendingConnect> connect,
+                        const boost::system::error_code &error);
+
+    void keepConnection(std::shared_ptr<socket_t> socket, boost::asio::ip::address_v4 remoteAddr,
+                        u32 rtt);
+    // false if kernel has no new RTT sample since last one
+    bool sampleConnection(Connection &connection, boost::asio::ip::address_v4 remoteAddr);
+    void asyncRead(std::shared_ptr<Connection> connection, boost::asio::ip::address_v4 remoteAddr);
+    void handleRead(std::shared_ptr<Connection> connection, boost::asio::ip::address_v4 remoteAddr,
+                    const boost::system::error_code &error);
+    static bool getTCPInfo(socket_t &socket, tcp_info &info);
 };
 
 #endif
\ No newline at end of file
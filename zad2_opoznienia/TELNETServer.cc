@@ -1,43 +1,59 @@
+#include <cmath>
 #include <boost/bind.hpp>
 #include <iostream>
 
 #include "TELNETServer.h"
 #include "settings.h"
 
-TELNETServer::TELNETServer(u16 port, LatencyDatabase &latencyDatabase)
-    : ioService(),
+TELNETServer::TELNETServer(boost::asio::io_service &ioService, u16 port,
+                           LatencyDatabase &latencyDatabase)
+    : ioService(ioService),
       acceptor(ioService, boost::asio::ip::tcp::endpoint(boost::asio::ip::tcp::v4(), port)),
       running(false),
+      refreshTimer(ioService),
       latencyDatabase(latencyDatabase) {
 }
 
 void TELNETServer::run(std::chrono::microseconds refreshTime) {
     if (!running) {
-        mainCommunicationThread = std::thread(&TELNETServer::startCommunication, this);
-        refreshDataThread = std::thread(&TELNETServer::refreshDataFunc, this, refreshTime);
+        this->refreshTime = refreshTime;
+        asyncAccept();
+        refreshTimer.expires_from_now(std::chrono::seconds(0));
+        asyncRefresh();
         running = true;
     } else {
         throw std::logic_error("already running");
     }
 }
 
-void TELNETServer::refreshDataFunc(std::chrono::microseconds refreshTime) {
-    while (true) {
-        updateData();
-        clientsMutex.lock();
-        auto it = clients.begin();
-        while (it != clients.end()) {
-            auto connection = it->lock();
-            if (!connection) {
-                it = clients.erase(it);
-            } else {
-                updateClientView(*connection);
-                ++it;
-            }
+void TELNETServer::asyncRefresh() {
+    refreshTimer.async_wait(
+        boost::bind(&TELNETServer::handleRefresh, this, boost::asio::placeholders::error));
+}
+
+void TELNETServer::handleRefresh(const boost::system::error_code &error) {
+    if (error) {
+        return;
+    }
+
+    updateData();
+    clientsMutex.lock();
+    auto it = clients.begin();
+    while (it != clients.end()) {
+        auto connection = it->lock();
+        if (!connection) {
+            it = clients.erase(it);
+        } else {
+            updateClientView(connection);
+            ++it;
         }
-        clientsMutex.unlock();
-        std::this_thread::sleep_for(refreshTime);
     }
+    clientsMutex.unlock();
+
+    // late refresh is not caught up
+    refreshTimer.expires_at(std::max(refreshTimer.expires_at() + refreshTime,
+                                     std::chrono::steady_clock::now()));
+    asyncRefresh();
 }
 
 void TELNETServer::updateData() {
@@ -109,54 +125,50 @@ std::string TELNETServer::getLatency(LatencyDatabase::ProtocolType protocol,
         return "-";
     }
 
+    // latency/jitter/loss, with trains (-K) followed by /min/dispersion of last train,
+    // all in microseconds except loss
     if (!data.isLatencyKnown(protocol)) {
-        return "?";
+        if (!data.getLostCount(protocol)) {
+            return "?";
+        }
+        return "?/?/100%";
     }
 
-    return std::to_string(data.getLatency(protocol).count());
+    std::string res = std::to_string(data.getLatency(protocol).count()) + "/" +
+                      std::to_string(data.getJitter(protocol).count()) + "/" +
+                      std::to_string((int)std::round(data.getLossRate(protocol) * 100)) + "%";
+    if (data.isTrainKnown(protocol)) {
+        res += "/" + std::to_string(data.getTrainMin(protocol).count()) + "/" +
+               std::to_string(data.getTrainDispersion(protocol).count());
+    }
+    return res;
 }
 
-void TELNETServer::updateClientView(TELNETServer::TCPConnection &connection) {
-    std::vector<std::vector<u8>> message;
-    message.push_back(clearDisplayMessage());
+void TELNETServer::updateClientView(std::shared_ptr<TELNETServer::TCPConnection> connection) {
+    std::vector<u8> message = clearDisplayMessage();
 
     dataMutex.lock();
     auto maxRow = std::min((unsigned)dataViewLines.size(),
-                           (unsigned)(connection.firstRowPos + CONSOLE_HEIGHT));
+                           (unsigned)(connection->firstRowPos + CONSOLE_HEIGHT));
     auto minRow = (maxRow <= CONSOLE_HEIGHT) ? 0 : maxRow - CONSOLE_HEIGHT;
 
     for (unsigned i = minRow; i < maxRow; i++) {
-        std::vector<u8> raw;
-        for (auto c : dataViewLines[i]) {
-            raw.push_back(c);
-        }
+        message.insert(message.end(), dataViewLines[i].begin(), dataViewLines[i].end());
 
         // newline
         if (i + 1 != maxRow) {
-            raw.push_back(u8(ESC));
-            raw.push_back('E');
+            message.push_back(u8(ESC));
+            message.push_back('E');
         }
-
-        message.push_back(raw);
     }
     dataMutex.unlock();
-    sendResponse(connection, message);
+    sendResponse(connection, std::move(message), true);
 }
 
 std::vector<u8> TELNETServer::clearDisplayMessage() const {
     return {ESC, '[', '2', 'J', ESC, '[', 'H'};
 }
 
-void TELNETServer::startCommunication() {
-    asyncAccept();
-
-    try {
-        ioService.run();
-    } catch (...) {
-        std::cerr << "TELNET Server aborted" << std::endl;
-    }
-}
-
 void TELNETServer::asyncAccept() {
     auto newConnection = std::make_shared<TCPConnection>(ioService);
     acceptor.async_accept(
@@ -173,19 +185,13 @@ void TELNETServer::handleAccept(const boost::system::error_code &error,
         return;
     }
 
-    boost::system::error_code ec;
-
-    connection->socketMutex.lock();
-    connection->socket.write_some(boost::asio::buffer(initialMsg), ec);
-    connection->socketMutex.unlock();
+    sendResponse(connection, initialMsg);
 
-    if (!ec) {
-        clientsMutex.lock();
-        clients.push_back(connection);
-        clientsMutex.unlock();
+    clientsMutex.lock();
+    clients.push_back(connection);
+    clientsMutex.unlock();
 
-        asyncRead(connection);
-    }
+    asyncRead(connection);
 }
 
 void TELNETServer::asyncRead(std::shared_ptr<TCPConnection> connection) {
@@ -222,14 +228,14 @@ void TELNETServer::handleRead(const boost::system::error_code &error, std::size_
             }
 
             if (data[1] == WILL) {
-                sendResponse(*connection, {IAC, DONT, data[2]});
+                sendResponse(connection, {IAC, DONT, data[2]});
             } else if (data[1] == DO) {
                 // receive response to two initial commands
                 if (connection->receivedCommandsCount < 2 &&
                     (data[2] == TELNET_ECHO || data[2] == SUPPRESS_GO_AHEAD)) {
                     // ignore
                 } else {
-                    sendResponse(*connection, {IAC, WONT, data[2]});
+                    sendResponse(connection, {IAC, WONT, data[2]});
                 }
                 connection->receivedCommandsCount++;
             }
@@ -242,7 +248,7 @@ void TELNETServer::handleRead(const boost::system::error_code &error, std::size_
             data.erase(data.begin());
             if (connection->firstRowPos > 0) {
                 connection->firstRowPos--;
-                updateClientView(*connection);
+                updateClientView(connection);
             }
             continue;
         }
@@ -253,7 +259,7 @@ void TELNETServer::handleRead(const boost::system::error_code &error, std::size_
             if (connection->firstRowPos + CONSOLE_HEIGHT < dataViewLines.size()) {
                 connection->firstRowPos++;
                 dataMutex.unlock();
-                updateClientView(*connection);
+                updateClientView(connection);
             } else {
                 dataMutex.unlock();
             }
@@ -261,30 +267,48 @@ void TELNETServer::handleRead(const boost::system::error_code &error, std::size_
         }
 
         // unknown character
-        sendResponse(*connection, std::vector<u8>{BELL});
+        sendResponse(connection, std::vector<u8>{BELL}, true);
         data.erase(data.begin());
     }
 
     asyncRead(connection);
 }
 
-void TELNETServer::sendResponse(TCPConnection &connection, const std::vector<u8> &data) {
-    boost::system::error_code ec;
-    connection.socketMutex.lock();
-    connection.socket.write_some(boost::asio::buffer(data), ec);
-    connection.socketMutex.unlock();
+void TELNETServer::sendResponse(std::shared_ptr<TCPConnection> connection, std::vector<u8> data,
+                                bool droppable) {
+    std::lock_guard<std::mutex> lock(connection->socketMutex);
+    if (droppable && connection->outgoing.size() >= MAX_QUEUED_MESSAGES) {
+        return;
+    }
+    connection->outgoing.push_back(std::move(data));
+    // otherwise handleWrite continues with it
+    if (connection->outgoing.size() == 1) {
+        asyncWrite(connection);
+    }
 }
 
-void TELNETServer::sendResponse(TCPConnection &connection,
-                                const std::vector<std::vector<u8>> &data) {
-    boost::system::error_code ec;
-    std::unique_lock<std::mutex>(connection.socketMutex);
+void TELNETServer::asyncWrite(std::shared_ptr<TCPConnection> connection) {
+    // deque doesn't move front element when more messages are queued
+    boost::asio::async_write(
+        connection->socket,
+        boost::asio::buffer(connection->outgoing.front()),
+        boost::bind(
+            &TELNETServer::handleWrite, this, boost::asio::placeholders::error, connection));
+}
 
-    for (auto &line : data) {
-        connection.socket.write_some(boost::asio::buffer(line), ec);
-        if (ec) {
-            break;
-        }
+void TELNETServer::handleWrite(const boost::system::error_code &error,
+                               std::shared_ptr<TCPConnection> connection) {
+    std::lock_guard<std::mutex> lock(connection->socketMutex);
+    if (error) {
+        // pending read fails too and connection is released
+        connection->outgoing.clear();
+        boost::system::error_code ec;
+        connection->socket.close(ec);
+        return;
+    }
+    connection->outgoing.pop_front();
+    if (!connection->outgoing.empty()) {
+        asyncWrite(connection);
     }
 }
 
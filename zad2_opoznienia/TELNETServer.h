@@ -1,20 +1,23 @@
 #ifndef TELNET_SERVER__H
 #define TELNET_SERVER__H
 
+#include <atomic>
 #include <chrono>
-#include <thread>
+#include <deque>
 #include <mutex>
 #include <list>
 #include <memory>
 
 #include <boost/asio.hpp>
+#include <boost/asio/steady_timer.hpp>
 
 #include "bitops.h"
 #include "LatencyDatabase.h"
 
 class TELNETServer {
 public:
-    TELNETServer(u16 port, LatencyDatabase &latencyDatabase);
+    // connections and refreshes are handled on ioService threads
+    TELNETServer(boost::asio::io_service &ioService, u16 port, LatencyDatabase &latencyDatabase);
 
     // run server in background
     void run(std::chrono::microseconds refreshTime);
@@ -34,42 +37,48 @@ private:
     static const u8 CONSOLE_HEIGHT = 24;
     static const u8 CONSOLE_WIDTH = 80;
 
+    // views are not queued for client which doesn't read them
+    static const unsigned MAX_QUEUED_MESSAGES = 8;
+
     static bool compareHostEntry(
         const std::pair<LatencyDatabase::addr_t, LatencyDatabase::Host> &a,
         const std::pair<LatencyDatabase::addr_t, LatencyDatabase::Host> &b);
 
     struct TCPConnection {
         boost::asio::ip::tcp::socket socket;
+        // guards socket operations and outgoing queue
         std::mutex socketMutex;
+        // messages waiting for async_write, front one is being written
+        std::deque<std::vector<u8>> outgoing;
         std::vector<u8> receivedData;
-        unsigned firstRowPos;
+        std::atomic<unsigned> firstRowPos;
         unsigned receivedCommandsCount;
 
         TCPConnection(boost::asio::io_service &ioService);
     };
 
-    boost::asio::io_service ioService;
+    boost::asio::io_service &ioService;
     boost::asio::ip::tcp::acceptor acceptor;
     std::list<std::weak_ptr<TCPConnection>> clients;
     std::mutex clientsMutex;
 
     bool running;
-    std::thread refreshDataThread;
-    std::thread mainCommunicationThread;
+    std::chrono::microseconds refreshTime;
+    boost::asio::steady_timer refreshTimer;
 
     LatencyDatabase &latencyDatabase;
 
     std::vector<std::string> dataViewLines;
     std::mutex dataMutex;
 
-    void refreshDataFunc(std::chrono::microseconds refreshTime);
+    void asyncRefresh();
+    void handleRefresh(const boost::system::error_code &error);
     void updateData();
     std::string getLatency(LatencyDatabase::ProtocolType protocol,
                            const LatencyDatabase::Host &data) const;
-    void updateClientView(TCPConnection &connection);
+    void updateClientView(std::shared_ptr<TCPConnection> connection);
     std::vector<u8> clearDisplayMessage() const;
 
-    void startCommunication();
     void asyncAccept();
     void asyncRead(std::shared_ptr<TCPConnection> connection);
     void sendInitialMessage(std::shared_ptr<TCPConnection> connection);
@@ -77,8 +86,14 @@ private:
                       std::shared_ptr<TCPConnection> connection);
     void handleRead(const boost::system::error_code &error, std::size_t bytesCount,
                     std::vector<u8> *rawBuf, std::shared_ptr<TCPConnection> connection);
-    void sendResponse(TCPConnection &connection, const std::vector<u8> &data);
-    void sendResponse(TCPConnection &connection, const std::vector<std::vector<u8>> &data);
+    // data is queued and written asynchronously, so that slow client doesn't block ioService
+    // droppable - message may be dropped if too many messages are queued already
+    void sendResponse(std::shared_ptr<TCPConnection> connection, std::vector<u8> data,
+                      bool droppable = false);
+    // socketMutex has to be locked
+    void asyncWrite(std::shared_ptr<TCPConnection> connection);
+    void handleWrite(const boost::system::error_code &error,
+                     std::shared_ptr<TCPConnection> connection);
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,44 @@
+#include "TimingWheel.h"
+
+TimingWheel::TimingWheel(tick_t now) : now(now) {
+}
+
+TimingWheel::tick_t TimingWheel::getNow() const {
+    return now;
+}
+
+TimingWheel::tick_t TimingWheel::schedule(u32 key, tick_t tick) {
+    if (tick - now - 1 >= MAX_DELAY) {
+        // in the past or too far away
+        tick = (tick <= now) ? now + 1 : now + MAX_DELAY;
+    }
+    insert(Entry{key, tick});
+    return tick;
+}
+
+void TimingWheel::insert(const Entry &entry) {
+    tick_t delay = entry.tick - now;
+    unsigned level = 0;
+    while (level + 1 < LEVELS_COUNT && delay >= (1u << (SLOT_BITS * (level + 1)))) {
+        level++;
+    }
+    slots[level][slotIdx(entry.tick, level)].push_back(entry);
+}
+
+void TimingWheel::cascade(unsigned level) {
+    // level is cascaded when all lower levels made full circle
+    if (level >= LEVELS_COUNT || (now & ((1u << (SLOT_BITS * level)) - 1)) != 0) {
+        return;
+    }
+    cascade(level + 1);
+
+    std::vector<Entry> entries;
+    entries.swap(slots[level][slotIdx(now, level)]);
+    for (const auto &entry : entries) {
+        insert(entry);
+    }
+}
+
+unsigned TimingWheel::slotIdx(tick_t tick, unsigned level) {
+    return (tick >> (SLOT_BITS * level)) & (SLOTS_COUNT - 1);
+}
@@ -0,0 +1,63 @@
+#ifndef TIMING_WHEEL__H
+#define TIMING_WHEEL__H
+
+#include <vector>
+
+#include "bitops.h"
+
+// Hierarchical timing wheel of u32 keys scheduled at u32 ticks.
+// Scheduling is O(1), advancing is amortized O(1) per tick and per scheduled key.
+// Not thread-safe.
+class TimingWheel {
+public:
+    using tick_t = u32;
+
+    TimingWheel(tick_t now = 0);
+
+    tick_t getNow() const;
+
+    // ticks not later than now are moved to now + 1,
+    // ticks further than MAX_DELAY are moved to now + MAX_DELAY
+    // returns tick at which key was actually scheduled
+    tick_t schedule(u32 key, tick_t tick);
+
+    // moves time forward to tick, calls onDue(key, scheduledTick) for every due key
+    // onDue may schedule keys again
+    template <typename F>
+    void advance(tick_t tick, F onDue);
+
+private:
+    static constexpr unsigned SLOT_BITS = 6;
+    static constexpr unsigned SLOTS_COUNT = 1 << SLOT_BITS;
+    static constexpr unsigned LEVELS_COUNT = 4;
+    static constexpr tick_t MAX_DELAY = (1u << (SLOT_BITS * LEVELS_COUNT)) - 1;
+
+    struct Entry {
+        u32 key;
+        tick_t tick;
+    };
+
+    tick_t now;
+    std::vector<Entry> slots[LEVELS_COUNT][SLOTS_COUNT];
+    std::vector<Entry> due;
+
+    void insert(const Entry &entry);
+    void cascade(unsigned level);
+    static unsigned slotIdx(tick_t tick, unsigned level);
+};
+
+template <typename F>
+void TimingWheel::advance(tick_t tick, F onDue) {
+    while (now < tick) {
+        now++;
+        cascade(1);
+
+        due.swap(slots[0][slotIdx(now, 0)]);
+        for (const auto &entry : due) {
+            onDue(entry.key, entry.tick);
+        }
+        due.clear();
+    }
+}
+
+#endif
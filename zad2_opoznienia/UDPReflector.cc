@@ -0,0 +1,116 @@
+#include <cstring>
+#include <iostream>
+#include <chrono>
+#include <unistd.h>
+
+#include "UDPReflector.h"
+
+UDPReflector::UDPReflector(u16 port, unsigned socketsCount)
+    : port(port), socketsCount(socketsCount), running(false) {
+}
+
+void UDPReflector::run() {
+    if (!running) {
+        // all sockets are bound before any thread starts, so failure leaves nothing running
+        for (unsigned i = 0; i < socketsCount; i++) {
+            sockets.push_back(openSocket());
+        }
+        for (int socket : sockets) {
+            threads.emplace_back(&UDPReflector::reflectThreadFunc, this, socket);
+        }
+        running = true;
+    } else {
+        throw std::logic_error("already running");
+    }
+}
+
+int UDPReflector::openSocket() {
+    int fd = ::socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd == -1) {
+        std::cerr << __func__ << ": " << strerror(errno) << "\n";
+        throw std::runtime_error("unable to open reflector socket");
+    }
+
+    int opt = 1;
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = bitops::hton(port);
+    addr.sin_addr.s_addr = bitops::hton((u32)INADDR_ANY);
+
+    if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) != 0 ||
+        bind(fd, (sockaddr *)&addr, sizeof(addr)) != 0) {
+        std::cerr << __func__ << ": " << strerror(errno) << "\n";
+        close(fd);
+        throw std::runtime_error("unable to bind reflector socket");
+    }
+    return fd;
+}
+
+void UDPReflector::reflectThreadFunc(int socket) {
+    Batch batch;
+
+    while (true) {
+        for (auto &msg : batch.messages) {
+            msg.msg_hdr.msg_namelen = sizeof(sockaddr_in);
+        }
+
+        // blocks until at least one request arrives, then takes whatever else is queued
+        int received =
+            recvmmsg(socket, batch.messages, UDP_BATCH_SIZE, MSG_WAITFORONE, nullptr);
+        if (received <= 0) {
+            if (received == -1 && errno != EINTR) {
+                std::cerr << __func__ << ": " << strerror(errno) << "\n";
+            }
+            continue;
+        }
+
+        unsigned count = prepareResponses(batch, received);
+        unsigned sent = 0;
+        while (sent < count) {
+            int res = sendmmsg(socket, batch.messages + sent, count - sent, 0);
+            // unreachable peer is skipped, like send_to errors were ignored
+            sent += (res > 0) ? res : 1;
+        }
+    }
+}
+
+// rewrites valid requests into responses in place, moving them to front of batch
+// returns number of responses
+unsigned UDPReflector::prepareResponses(Batch &batch, unsigned received) {
+    // responses of one batch leave in one syscall, so they share response time
+    u64 responseTime = std::chrono::duration_cast<std::chrono::microseconds>(
+                           std::chrono::system_clock::now().time_since_epoch())
+                           .count();
+    responseTime = bitops::hton(responseTime);
+
+    unsigned count = 0;
+    for (unsigned i = 0; i < received; i++) {
+        if (batch.messages[i].msg_len != REQUEST_SIZE) {
+            continue;
+        }
+        if (count != i) {
+            memcpy(batch.buffers[count], batch.buffers[i], REQUEST_SIZE);
+            batch.addrs[count] = batch.addrs[i];
+            batch.messages[count].msg_hdr.msg_namelen = batch.messages[i].msg_hdr.msg_namelen;
+        }
+        // send time is echoed as it was received, in network order
+        memcpy(batch.buffers[count] + REQUEST_SIZE, &responseTime, sizeof(responseTime));
+        count++;
+    }
+    return count;
+}
+
+UDPReflector::Batch::Batch() {
+    memset(messages, 0, sizeof(messages));
+    memset(addrs, 0, sizeof(addrs));
+    for (unsigned i = 0; i < UDP_BATCH_SIZE; i++) {
+        iovecs[i].iov_base = buffers[i];
+        iovecs[i].iov_len = RESPONSE_SIZE;
+
+        messages[i].msg_hdr.msg_name = &addrs[i];
+        messages[i].msg_hdr.msg_namelen = sizeof(sockaddr_in);
+        messages[i].msg_hdr.msg_iov = &iovecs[i];
+        messages[i].msg_hdr.msg_iovlen = 1;
+    }
+}
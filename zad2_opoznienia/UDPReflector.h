@@ -0,0 +1,55 @@
+#ifndef UDP_REFLECTOR__H
+#define UDP_REFLECTOR__H
+
+#include <thread>
+#include <vector>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "bitops.h"
+#include "settings.h"
+
+// Server side of UDP measurement: answers requests of other instances.
+// Opens socketsCount sockets bound to the same port with SO_REUSEPORT, kernel spreads
+// peers between them. Each socket is served by its own thread, which receives
+// UDP_BATCH_SIZE requests with one recvmmsg, writes responses in place of requests
+// and sends them back with one sendmmsg.
+class UDPReflector {
+public:
+    UDPReflector(u16 port, unsigned socketsCount);
+    UDPReflector(const UDPReflector &) = delete;
+    UDPReflector(UDPReflector &&) = delete;
+    UDPReflector &operator=(const UDPReflector &) = delete;
+    UDPReflector &operator=(UDPReflector &&) = delete;
+
+    // run reflector in background
+    void run();
+
+private:
+    // request: send time, response: send time, response time
+    static const unsigned REQUEST_SIZE = sizeof(u64);
+    static const unsigned RESPONSE_SIZE = 2 * sizeof(u64);
+
+    struct Batch {
+        Batch();
+
+        mmsghdr messages[UDP_BATCH_SIZE];
+        iovec iovecs[UDP_BATCH_SIZE];
+        sockaddr_in addrs[UDP_BATCH_SIZE];
+        // requests are received into the same buffers in which responses are built,
+        // longer datagrams are truncated and ignored
+        u8 buffers[UDP_BATCH_SIZE][RESPONSE_SIZE];
+    };
+
+    u16 port;
+    unsigned socketsCount;
+    bool running;
+    std::vector<int> sockets;
+    std::vector<std::thread> threads;
+
+    int openSocket();
+    void reflectThreadFunc(int socket);
+    unsigned prepareResponses(Batch &batch, unsigned received);
+};
+
+#endif
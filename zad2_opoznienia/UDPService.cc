@@ -1,23 +1,34 @@
+#include <algorithm>
+#include <cstring>
+#include <iostream>
 #include <boost/bind.hpp>
 
 #include "UDPService.h"
 #include "settings.h"
 
 UDPService::UDPService(boost::asio::io_service &ioServiceForListening,
-                       LatencyDatabase &latencyDatabase, u16 serverPort)
+                       LatencyDatabase &latencyDatabase, u16 serverPort, bool kernelTimestamps,
+                       bool serveRequests)
     : port(serverPort),
       listening(false),
+      kernelTimestamps(kernelTimestamps),
+      serveRequests(serveRequests),
       clientSocket(ioServiceForListening),
       serverSocket(ioServiceForListening),
-      clientBuffer(BUFFER_SIZE),
       serverBuffer(BUFFER_SIZE),
-      latencyDatabase(latencyDatabase) {
+      lastRequestTime(0),
+      latencyDatabase(latencyDatabase),
+      requests(PENDING_PROBES_BITS) {
+    receivedResponses.reserve(UDP_BATCH_SIZE);
+    latencies.reserve(UDP_BATCH_SIZE);
 }
 
 void UDPService::startListening() {
     if (!listening) {
         prepareSockets();
-        asyncServerReceive();
+        if (serveRequests) {
+            asyncServerReceive();
+        }
         asyncClientReceive();
         listening = true;
     } else {
@@ -28,8 +39,15 @@ void UDPService::startListening() {
 void UDPService::prepareSockets() {
     using namespace boost::asio;
     clientSocket.open(ip::udp::v4());
-    serverSocket.open(ip::udp::v4());
-    serverSocket.bind(ip::udp::endpoint(ip::udp::v4(), port));
+    if (serveRequests) {
+        serverSocket.open(ip::udp::v4());
+        serverSocket.bind(ip::udp::endpoint(ip::udp::v4(), port));
+    }
+
+    if (kernelTimestamps && !timestamping::enable(clientSocket.native_handle())) {
+        std::cerr << __func__ << ": " << strerror(errno) << "\n";
+        throw std::runtime_error("unable to enable kernel timestamps");
+    }
 }
 
 void UDPService::asyncServerReceive() {
@@ -57,37 +75,79 @@ void UDPService::handleServerInput(const boost::system::error_code &error, std::
 
 void UDPService::asyncClientReceive() {
     clientSocketMutex.lock();
-    clientSocket.async_receive_from(boost::asio::buffer(clientBuffer),
-                                    clientSocketSenderEndpoint,
-                                    boost::bind(&UDPService::handleClientInput,
-                                                this,
-                                                boost::asio::placeholders::error,
-                                                boost::asio::placeholders::bytes_transferred));
+    clientSocket.async_wait(
+        boost::asio::ip::udp::socket::wait_read,
+        boost::bind(&UDPService::handleClientInput, this, boost::asio::placeholders::error));
     clientSocketMutex.unlock();
 }
 
-void UDPService::handleClientInput(const boost::system::error_code &error, std::size_t bytesCount) {
-    if (!error && bytesCount == 2 * sizeof(u64)) {
-        handleClientResponse(clientSocketSenderEndpoint.address().to_v4());
+void UDPService::handleClientInput(const boost::system::error_code &error) {
+    if (!error) {
+        for (auto &msg : receiveBatch.messages) {
+            msg.msg_hdr.msg_namelen = sizeof(sockaddr_in);
+            msg.msg_hdr.msg_controllen = timestamping::CONTROL_BUFFER_SIZE;
+        }
+
+        int received = recvmmsg(clientSocket.native_handle(),
+                                receiveBatch.messages,
+                                UDP_BATCH_SIZE,
+                                MSG_DONTWAIT,
+                                nullptr);
+
+        receivedResponses.clear();
+        for (int i = 0; i < received; i++) {
+            auto &msg = receiveBatch.messages[i];
+            if (msg.msg_len == 2 * sizeof(u64) && !(msg.msg_hdr.msg_flags & MSG_TRUNC)) {
+                Message response(receiveBatch.buffers[i]);
+                HistoryEntry request{bitops::ntoh((u32)receiveBatch.addrs[i].sin_addr.s_addr),
+                                     response.sendTime};
+                u64 receiveTime = 0;
+                std::chrono::steady_clock::time_point kernelTime;
+                if (kernelTimestamps && timestamping::getReceiveTime(&msg.msg_hdr, kernelTime)) {
+                    receiveTime = std::chrono::duration_cast<std::chrono::microseconds>(
+                                      kernelTime.time_since_epoch())
+                                      .count();
+                }
+                receivedResponses.push_back(Response{request, receiveTime});
+            }
+        }
+        handleClientResponses();
     }
     asyncClientReceive();
 }
 
-void UDPService::handleClientResponse(const boost::asio::ip::address_v4 &senderAddr) {
-    Message msg(clientBuffer);
-    u64 curTime = getCurTime();
-    HistoryEntry request{bitops::addrToU32(senderAddr), msg.sendTime};
+void UDPService::handleClientResponses() {
+    if (receivedResponses.empty()) {
+        return;
+    }
+    u64 curTime = getMonotonicTime();
 
+    latencies.clear();
     historyMutex.lock();
     refreshHistory();
-    if (requests.find(request) != requests.end()) {
-        LatencyDatabase::latency_t latency = std::chrono::microseconds(curTime - request.sendTime);
-        requests.erase(request);
-        historyMutex.unlock();
+    for (auto &response : receivedResponses) {
+        if (!response.receiveTime) {
+            response.receiveTime = curTime;
+        }
+        handleClientResponse(response);
+    }
+    historyMutex.unlock();
 
-        latencyDatabase.addLatency(LatencyDatabase::ProtocolType::UDP, senderAddr, latency);
-    } else {
-        historyMutex.unlock();
+    for (const auto &latency : latencies) {
+        latencyDatabase.addLatency(
+            LatencyDatabase::ProtocolType::UDP, latency.first, latency.second);
+    }
+}
+
+// historyMutex has to be locked
+void UDPService::handleClientResponse(const Response &response) {
+    const HistoryEntry &request = response.request;
+    PendingProbeTable::Probe probe;
+    if (requests.remove(request.peerAddr, request.sendTime, probe) &&
+        response.receiveTime >= probe.sendTime) {
+        latencies.push_back(
+            std::make_pair(bitops::u32ToAddr(request.peerAddr),
+                           std::chrono::microseconds(response.receiveTime - probe.sendTime)));
     }
 }
 
@@ -96,39 +156,93 @@ void UDPService::refreshHistory() {
                                       std::chrono::seconds(MAX_LATENCY_SECS))
                                       .count();
 
-    u64 curTime = getCurTime();
-    while (!requestHistory.empty() && requestHistory.front().sendTime < curTime - maxLatency) {
-        if (requests.find(requestHistory.front()) != requests.end()) {
-            requests.erase(requestHistory.front());
-        }
-        requestHistory.pop();
+    // bounded, so that one call doesn't stall handling of responses
+    static const unsigned maxExpiredCount = 2 * UDP_BATCH_SIZE;
+
+    u64 curTime = getMonotonicTime();
+    requests.expire(curTime - maxLatency,
+                    maxExpiredCount,
+                    [this](const PendingProbeTable::Probe &p) { reportLoss(p); });
+}
+
+void UDPService::reportLoss(const PendingProbeTable::Probe &probe) {
+    latencyDatabase.addLoss(LatencyDatabase::ProtocolType::UDP, bitops::u32ToAddr(probe.peer));
+}
+
+void UDPService::measureLatency(const std::vector<boost::asio::ip::udp::endpoint> &targets) {
+    for (std::size_t first = 0; first < targets.size(); first += UDP_BATCH_SIZE) {
+        sendRequests(targets.data() + first,
+                     std::min(targets.size() - first, (std::size_t)UDP_BATCH_SIZE));
     }
 }
 
-void UDPService::measureLatency(const std::vector<boost::asio::ip::address_v4> &addrs) {
-    for (auto addr : addrs) {
-        historyMutex.lock();
+void UDPService::sendRequests(const boost::asio::ip::udp::endpoint *targets, unsigned count) {
+    // whole batch leaves in one syscall, so it shares send time
+    // system clock time identifies request, steady clock one is used for measurement
+    // every request gets its own microsecond, so that instances of one host on
+    // different ports are told apart
+    u64 curTime = std::max(getCurTime(), lastRequestTime + 1);
+    lastRequestTime = curTime + count - 1;
+    u64 sendTime = getMonotonicTime();
+    for (unsigned i = 0; i < count; i++) {
+        u64 request = bitops::hton(curTime + i);
+        memcpy(sendBatch.buffers[i].data(), &request, sizeof(request));
+    }
 
-        u64 curTime = getCurTime();
-        std::vector<u8> request = bitops::divide(curTime);
-        HistoryEntry hEntry{bitops::addrToU32(addr), curTime};
-        requestHistory.push(hEntry);
-        requests.insert(hEntry);
+    historyMutex.lock();
+    refreshHistory();
+    for (unsigned i = 0; i < count; i++) {
+        u32 peer = bitops::addrToU32(targets[i].address().to_v4());
+        requests.insert(PendingProbeTable::Probe{peer, curTime + i, sendTime},
+                        [this](const PendingProbeTable::Probe &p) { reportLoss(p); });
+    }
+    historyMutex.unlock();
 
-        historyMutex.unlock();
+    for (unsigned i = 0; i < count; i++) {
+        sendBatch.addrs[i].sin_family = AF_INET;
+        sendBatch.addrs[i].sin_port = bitops::hton(targets[i].port() ? targets[i].port() : port);
+        sendBatch.addrs[i].sin_addr.s_addr =
+            bitops::hton(bitops::addrToU32(targets[i].address().to_v4()));
+        sendBatch.iovecs[i].iov_base = sendBatch.buffers[i].data();
+        sendBatch.iovecs[i].iov_len = sizeof(u64);
+    }
 
-        boost::system::error_code ec;
-        clientSocketMutex.lock();
-        clientSocket.send_to(boost::asio::buffer(request),
-                             boost::asio::ip::udp::endpoint(addr, port),
-                             boost::asio::ip::udp::socket::message_flags(),
-                             ec);
-        clientSocketMutex.unlock();
+    unsigned sent = 0;
+    clientSocketMutex.lock();
+    while (sent < count) {
+        int res =
+            sendmmsg(clientSocket.native_handle(), sendBatch.messages + sent, count - sent, 0);
+        if (res > 0) {
+            sent += res;
+        } else if (res == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            // socket is non-blocking because of pending async_wait
+            boost::system::error_code ec;
+            clientSocket.wait(boost::asio::ip::udp::socket::wait_write, ec);
+            if (ec) {
+                break;
+            }
+        } else {
+            // skip unreachable peer, like send_to errors were ignored
+            sent++;
+        }
     }
+    clientSocketMutex.unlock();
 }
 
-bool UDPService::HistoryEntry::operator<(const UDPService::HistoryEntry &that) const {
-    return std::make_pair(peerAddr, sendTime) < std::make_pair(that.peerAddr, that.sendTime);
+UDPService::Batch::Batch() {
+    memset(messages, 0, sizeof(messages));
+    memset(addrs, 0, sizeof(addrs));
+    for (unsigned i = 0; i < UDP_BATCH_SIZE; i++) {
+        buffers[i].resize(SMALL_BUFFER_SIZE);
+        iovecs[i].iov_base = buffers[i].data();
+        iovecs[i].iov_len = buffers[i].size();
+
+        messages[i].msg_hdr.msg_name = &addrs[i];
+        messages[i].msg_hdr.msg_namelen = sizeof(sockaddr_in);
+        messages[i].msg_hdr.msg_iov = &iovecs[i];
+        messages[i].msg_hdr.msg_iovlen = 1;
+        messages[i].msg_hdr.msg_control = controls[i];
+    }
 }
 
 UDPService::Message::Message(const std::vector<u8> &rawData) {
@@ -150,3 +264,9 @@ u64 UDPService::getCurTime() const {
                   .count();
     return res;
 }
+
+u64 UDPService::getMonotonicTime() const {
+    auto curTimePoint = std::chrono::steady_clock::now();
+    return std::chrono::duration_cast<std::chrono::microseconds>(curTimePoint.time_since_epoch())
+        .count();
+}
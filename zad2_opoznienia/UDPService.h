@@ -3,36 +3,49 @@
 
 #include <memory>
 #include <mutex>
-#include <queue>
-#include <set>
 #include <chrono>
+#include <sys/socket.h>
+#include <netinet/in.h>
 #include <boost/asio.hpp>
 
 #include "LatencyDatabase.h"
+#include "PendingProbeTable.h"
 #include "bitops.h"
+#include "settings.h"
+#include "timestamping.h"
 
 class UDPService {
 public:
+    // kernelTimestamps - take receive times of responses from kernel (SO_TIMESTAMPING)
+    // serveRequests - answer requests on serverPort, false when UDPReflector does it
     UDPService(boost::asio::io_service &ioServiceForListening, LatencyDatabase &latencyDatabase,
-               u16 serverPort);
+               u16 serverPort, bool kernelTimestamps = false, bool serveRequests = true);
     UDPService() = default;
     UDPService(const UDPService &) = delete;
     UDPService(UDPService &&) = delete;
     UDPService &operator=(const UDPService &) = delete;
     UDPService &operator=(UDPService &&) = delete;
 
+    // receive asynchronously, handlers on ioServiceForListening threads
+    // each socket has at most one pending operation, so its handlers never run concurrently
     void startListening();
 
-    // send requests synchronously on caller thread
+    // send requests synchronously on caller thread, UDP_BATCH_SIZE per syscall
+    // targets with port 0 are sent to serverPort
     // calls from several threads at the same time are prohibited
-    void measureLatency(const std::vector<boost::asio::ip::address_v4> &addrs);
+    void measureLatency(const std::vector<boost::asio::ip::udp::endpoint> &targets);
 
 private:
     struct HistoryEntry {
         u32 peerAddr;
+        // system clock, as sent in request
         u64 sendTime;
+    };
 
-        bool operator<(const HistoryEntry &that) const;
+    struct Response {
+        HistoryEntry request;
+        // steady clock
+        u64 receiveTime;
     };
 
     struct Message {
@@ -46,21 +59,37 @@ private:
 
     u16 port;
     bool listening;
+    bool kernelTimestamps;
+    bool serveRequests;
 
     boost::asio::ip::udp::socket clientSocket;
     boost::asio::ip::udp::socket serverSocket;
 
     std::mutex clientSocketMutex;
 
-    boost::asio::ip::udp::endpoint clientSocketSenderEndpoint;
     boost::asio::ip::udp::endpoint serverSocketSenderEndpoint;
-    std::vector<u8> clientBuffer;
     std::vector<u8> serverBuffer;
 
+    // sendmmsg/recvmmsg state, used by one thread at a time
+    struct Batch {
+        Batch();
+
+        mmsghdr messages[UDP_BATCH_SIZE];
+        iovec iovecs[UDP_BATCH_SIZE];
+        sockaddr_in addrs[UDP_BATCH_SIZE];
+        std::vector<u8> buffers[UDP_BATCH_SIZE];
+        char controls[UDP_BATCH_SIZE][timestamping::CONTROL_BUFFER_SIZE];
+    };
+    Batch sendBatch;
+    // system clock time of last request sent, used only by measureLatency
+    u64 lastRequestTime;
+    Batch receiveBatch;
+    std::vector<Response> receivedResponses;
+    std::vector<std::pair<boost::asio::ip::address_v4, LatencyDatabase::latency_t>> latencies;
+
     LatencyDatabase &latencyDatabase;
 
-    std::queue<HistoryEntry> requestHistory;
-    std::set<HistoryEntry> requests;
+    PendingProbeTable requests;
     std::mutex historyMutex;
 
     void prepareSockets();
@@ -69,11 +98,19 @@ private:
     void asyncClientReceive();
 
     void handleServerInput(const boost::system::error_code &error, std::size_t bytesCount);
-    void handleClientInput(const boost::system::error_code &error, std::size_t bytesCount);
-    void handleClientResponse(const boost::asio::ip::address_v4 &senderAddr);
+    void handleClientInput(const boost::system::error_code &error);
+    void handleClientResponses();
+    void handleClientResponse(const Response &response);
+
+    void sendRequests(const boost::asio::ip::udp::endpoint *targets, unsigned count);
 
     void refreshHistory();
+    // historyMutex has to be locked
+    void reportLoss(const PendingProbeTable::Probe &probe);
+    // system clock, used only in messages
     u64 getCurTime() const;
+    // steady clock, used for measurements
+    u64 getMonotonicTime() const;
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,146 @@
+#include <chrono>
+#include <cstdio>
+#include <queue>
+#include <random>
+#include <set>
+#include <vector>
+
+#include "PendingProbeTable.h"
+#include "settings.h"
+
+// Per-probe cost of tracking in-flight UDP probes: PendingProbeTable against
+// std::queue + std::set used by UDPService before it.
+// Every probe is inserted, then answered in random order or lost and expired by timeout.
+
+namespace {
+
+const unsigned PROBES = 2000000;
+// one of LOSS_EVERY probes is never answered
+const unsigned LOSS_EVERY = 20;
+
+struct HistoryEntry {
+    u32 peerAddr;
+    u64 sendTime;
+
+    bool operator<(const HistoryEntry &that) const {
+        return std::make_pair(peerAddr, sendTime) < std::make_pair(that.peerAddr, that.sendTime);
+    }
+};
+
+// the same sequence of probes and answers for both containers
+struct Workload {
+    std::vector<HistoryEntry> probes;
+    // index of probe answered after each send, PROBES if none
+    std::vector<unsigned> answers;
+};
+
+Workload makeWorkload(unsigned inFlight) {
+    std::mt19937 random(inFlight);
+    Workload w;
+    std::vector<unsigned> pending;
+    for (unsigned i = 0; i < PROBES; i++) {
+        // 1 us between probes, so inFlight probes span inFlight us
+        w.probes.push_back(HistoryEntry{(u32)(random() % 4096), (u64)i * 1000});
+        if (i % LOSS_EVERY) {
+            pending.push_back(i);
+        }
+        unsigned answer = PROBES;
+        if (pending.size() > inFlight) {
+            std::swap(pending[random() % pending.size()], pending.back());
+            answer = pending.back();
+            pending.pop_back();
+        }
+        w.answers.push_back(answer);
+    }
+    return w;
+}
+
+// probes older than timeout are expired, as UDPService does after every batch
+u64 timeoutFor(unsigned inFlight) {
+    return (u64)inFlight * 1000 * 4;
+}
+
+// ring of table has to hold every probe sent within timeout, otherwise oldest are expired early
+unsigned capacityBitsFor(unsigned inFlight) {
+    unsigned bits = PENDING_PROBES_BITS;
+    while ((1u << bits) < inFlight * 4) {
+        bits++;
+    }
+    return bits;
+}
+
+double benchTable(const Workload &w, unsigned inFlight) {
+    PendingProbeTable table(capacityBitsFor(inFlight));
+    u64 timeout = timeoutFor(inFlight);
+    unsigned answered = 0;
+    unsigned expired = 0;
+    auto onExpired = [&](const PendingProbeTable::Probe &) { expired++; };
+
+    auto start = std::chrono::steady_clock::now();
+    for (unsigned i = 0; i < PROBES; i++) {
+        const auto &p = w.probes[i];
+        table.insert(PendingProbeTable::Probe{p.peerAddr, p.sendTime, p.sendTime}, onExpired);
+        if (w.answers[i] != PROBES) {
+            const auto &a = w.probes[w.answers[i]];
+            PendingProbeTable::Probe probe;
+            answered += table.remove(a.peerAddr, a.sendTime, probe);
+        }
+        if (i % UDP_BATCH_SIZE == 0 && p.sendTime > timeout) {
+            table.expire(p.sendTime - timeout, 2 * UDP_BATCH_SIZE, onExpired);
+        }
+    }
+    auto elapsed = std::chrono::steady_clock::now() - start;
+
+    std::printf("  PendingProbeTable: answered %u, expired %u\n", answered, expired);
+    return std::chrono::duration<double, std::nano>(elapsed).count() / PROBES;
+}
+
+double benchSet(const Workload &w, unsigned inFlight) {
+    std::queue<HistoryEntry> requestHistory;
+    std::set<HistoryEntry> requests;
+    u64 timeout = timeoutFor(inFlight);
+    unsigned answered = 0;
+    unsigned expired = 0;
+
+    auto start = std::chrono::steady_clock::now();
+    for (unsigned i = 0; i < PROBES; i++) {
+        const auto &p = w.probes[i];
+        requestHistory.push(p);
+        requests.insert(p);
+        if (w.answers[i] != PROBES) {
+            const auto &a = w.probes[w.answers[i]];
+            if (requests.find(a) != requests.end()) {
+                requests.erase(a);
+                answered++;
+            }
+        }
+        if (i % UDP_BATCH_SIZE == 0) {
+            while (!requestHistory.empty() &&
+                   requestHistory.front().sendTime + timeout < p.sendTime) {
+                if (requests.find(requestHistory.front()) != requests.end()) {
+                    requests.erase(requestHistory.front());
+                    expired++;
+                }
+                requestHistory.pop();
+            }
+        }
+    }
+    auto elapsed = std::chrono::steady_clock::now() - start;
+
+    std::printf("  std::queue + std::set: answered %u, expired %u\n", answered, expired);
+    return std::chrono::duration<double, std::nano>(elapsed).count() / PROBES;
+}
+}
+
+int main() {
+    for (unsigned inFlight : {1000u, 10000u, 20000u, 50000u}) {
+        std::printf(
+            "%u probes in flight, table of 2^%u probes\n", inFlight, capacityBitsFor(inFlight));
+        Workload w = makeWorkload(inFlight);
+        double table = benchTable(w, inFlight);
+        double set = benchSet(w, inFlight);
+        std::printf("  ns per probe: PendingProbeTable %.1f, std::queue + std::set %.1f\n",
+                    table,
+                    set);
+    }
+}
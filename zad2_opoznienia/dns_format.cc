@@ -44,16 +44,6 @@ std::string domainToString(const std::vector<u8> &domain) {
     return res;
 }
 
-std::vector<u8> firstLabel(const std::vector<u8> &domain) {
-    u8 count = domain[0];
-    std::vector<u8> res(count + 2);
-    for (u8 i = 0; i <= count; i++) {
-        res[i] = domain[i];
-    }
-    res[count + 1] = 0;
-    return res;
-}
-
 std::vector<u8> withoutFirstLabel(const std::vector<u8> &domain) {
     u8 prefix = domain[0];
     std::vector<u8> res(domain.size() - prefix - 1);
@@ -63,49 +53,6 @@ std::vector<u8> withoutFirstLabel(const std::vector<u8> &domain) {
     return res;
 }
 
-DNSPacket::Question getQuestion(raw_data_it begin, raw_data_it &it, raw_data_it end) {
-    DNSPacket::Question question;
-    question.qname = getDomainName(begin, it, end);
-    question.qtype = bitops::getU16(it, end);
-    question.qclass = bitops::getU16(it, end);
-    question.unicastResponseRequested = question.qclass & (1 << 15);
-    question.qclass &= 0x7F;
-    return question;
-}
-
-DNSPacket::ResourceRecord getResourceRecord(raw_data_it begin, raw_data_it &it, raw_data_it end) {
-    DNSPacket::ResourceRecord rr;
-    rr.name = getDomainName(begin, it, end);
-    u16 rrtype = bitops::getU16(it, end);
-    rr.rrclass = bitops::getU16(it, end);
-    rr.ttl = bitops::getU32(it, end);
-    u16 rdlength = bitops::getU16(it, end);
-
-    if (rrtype == DNSPacket::DNSType::PTR) {
-        rr.setPTRAnswer(getDomainName(begin, it, end));
-
-        if (dns_format::withoutFirstLabel(rr.getPtrAnswer()) != rr.name) {
-            // name != [name].service.local.
-            throw UnknownFormatException();
-        }
-    } else if (rrtype == DNSPacket::DNSType::A) {
-        if (rdlength != 4) {
-            throw UnknownFormatException{};
-        }
-        rr.setAAnswer(bitops::getU32(it, end));
-    } else {
-        for (unsigned i = 0; i < rdlength; i++) {
-            // don't need that
-            (void)bitops::getU8(it, end);
-        }
-    }
-
-    // don't want top bit
-    rr.rrclass &= 0x7F;
-
-    return rr;
-}
-
 bool isPointer(u8 octet) {
     return (octet & 0xC0) == 0xC0;
 }
@@ -114,52 +61,4 @@ u8 getOffset(u8 pointer) {
     return pointer & (0xFF - 0xC0);
 }
 
-std::vector<u8> getDomainName(raw_data_it begin, raw_data_it &it, raw_data_it end, u16 maxLength) {
-    std::vector<u8> res;
-    unsigned count = 1;
-
-    while (true) {
-        if (maxLength == 0) {
-            throw UnknownFormatException();
-        }
-        res.push_back(bitops::getU8(it, end));
-        maxLength--;
-
-        if (--count == 0) {
-            if (res.back() == 0) {
-                break;
-            }
-
-            if (isPointer(res.back())) {
-                u16 offset = getOffset(res.back());
-                if (maxLength == 0) {
-                    throw UnknownFormatException();
-                }
-                offset = (offset << 8) + bitops::getU8(it, end);
-                maxLength--;
-                res.pop_back();
-
-                auto newIt = begin + offset;
-                if (offset >= end - begin) {
-                    throw UnknownFormatException("error in compression");
-                }
-                auto fromPtr = getDomainName(begin, newIt, end, maxLength);
-                for (auto octet : fromPtr) {
-                    res.push_back(octet);
-                }
-                break;
-            }
-
-            count = res.back() + 1;
-        }
-    }
-
-    for (auto c : res) {
-        if (c >= 'A' && c <= 'Z') {
-            c = c - 'A' + 'a';
-        }
-    }
-    return res;
-}
-
 }  // dns_format
\ No newline at end of file
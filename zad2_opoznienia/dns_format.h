@@ -13,13 +13,7 @@ u8 getOffset(u8 pointer);
 std::vector<u8> stringToDomain(const std::string &str);
 std::string domainToString(const std::vector<u8> &domain);
 
-std::vector<u8> firstLabel(const std::vector<u8> &domain);
 std::vector<u8> withoutFirstLabel(const std::vector<u8> &domain);
-
-std::vector<u8> getDomainName(raw_data_it begin, raw_data_it &it, raw_data_it end,
-                              u16 maxLength = 255);
-DNSPacket::Question getQuestion(raw_data_it begin, raw_data_it &it, raw_data_it end);
-DNSPacket::ResourceRecord getResourceRecord(raw_data_it begin, raw_data_it &it, raw_data_it end);
 }
 
 #endif
\ No newline at end of file
@@ -0,0 +1,147 @@
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <thread>
+#include <vector>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <boost/asio/steady_timer.hpp>
+
+#include "ICMPService.h"
+#include "LatencyDatabase.h"
+#include "ProbeScheduler.h"
+#include "TCPService.h"
+#include "UDPService.h"
+
+// Load driver for reply processing: probes many loopback hosts with the services and scheduler
+// of opoznienia, run on io service by given number of threads as with -j, and reports replies
+// recorded in database per second.
+// Hosts are 127.1.0.0 and following addresses, answered by kernel (ICMP) and by reflector
+// threads of this driver (UDP), which reply from the address request was sent to.
+// Usage: load_probes threads [hosts] [seconds]
+// e.g. for j in 1 2 4 8; do ./load_probes $j 20000 10; done
+
+namespace {
+
+const u16 REFLECTOR_PORT = 47321;
+const unsigned REFLECTOR_THREADS = 2;
+const u32 FIRST_HOST = 0x7F010000;
+
+int openReflectorSocket() {
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    int opt = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt));
+    setsockopt(fd, IPPROTO_IP, IP_PKTINFO, &opt, sizeof(opt));
+
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = bitops::hton(REFLECTOR_PORT);
+    addr.sin_addr.s_addr = INADDR_ANY;
+    if (bind(fd, (sockaddr *)&addr, sizeof(addr)) != 0) {
+        std::cerr << __func__ << ": " << strerror(errno) << "\n";
+        exit(EXIT_FAILURE);
+    }
+    return fd;
+}
+
+// answers as UDPReflector does, but from the address request was sent to,
+// otherwise every reply would come from 127.0.0.1
+void reflect(int fd) {
+    u8 buffer[2 * sizeof(u64)];
+    char control[CMSG_SPACE(sizeof(in_pktinfo))];
+    while (true) {
+        sockaddr_in peer;
+        iovec iov{buffer, sizeof(buffer)};
+        msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_name = &peer;
+        msg.msg_namelen = sizeof(peer);
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        if (recvmsg(fd, &msg, 0) != sizeof(u64)) {
+            continue;
+        }
+
+        cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        if (!cmsg || cmsg->cmsg_level != IPPROTO_IP || cmsg->cmsg_type != IP_PKTINFO) {
+            continue;
+        }
+        auto pktinfo = (in_pktinfo *)CMSG_DATA(cmsg);
+        pktinfo->ipi_spec_dst = pktinfo->ipi_addr;
+        pktinfo->ipi_ifindex = 0;
+
+        // response time is not used by measurement
+        memset(buffer + sizeof(u64), 0, sizeof(u64));
+        iov.iov_len = sizeof(buffer);
+        msg.msg_controllen = CMSG_SPACE(sizeof(in_pktinfo));
+        sendmsg(fd, &msg, 0);
+    }
+}
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        std::cout << "Usage: " << argv[0] << " threads [hosts] [seconds]" << std::endl;
+        return EXIT_FAILURE;
+    }
+    unsigned threadsCount = std::max(atoi(argv[1]), 1);
+    unsigned hostsCount = argc > 2 ? std::max(atoi(argv[2]), 1) : 10000;
+    unsigned seconds = argc > 3 ? std::max(atoi(argv[3]), 1) : 10;
+
+    for (unsigned i = 0; i < REFLECTOR_THREADS; i++) {
+        std::thread(reflect, openReflectorSocket()).detach();
+    }
+
+    // window holds whole run
+    LatencyDatabase lb(std::chrono::seconds(4 * seconds));
+    for (unsigned i = 0; i < hostsCount; i++) {
+        auto addr = bitops::u32ToAddr(FIRST_HOST + i);
+        lb.setConnectionAvailable(
+            LatencyDatabase::ProtocolType::UDP, addr, std::chrono::hours(1), REFLECTOR_PORT);
+    }
+
+    boost::asio::io_service io;
+    UDPService udp(io, lb, REFLECTOR_PORT, false, false);
+    ICMPService icmp(io, lb);
+    TCPService tcp(io, lb);
+    ProbeScheduler scheduler(io, lb, udp, icmp, tcp, std::chrono::seconds(1), 0);
+
+    udp.startListening();
+    icmp.startListening();
+    scheduler.start();
+
+    boost::asio::steady_timer stopTimer(io);
+    stopTimer.expires_from_now(std::chrono::seconds(seconds));
+    stopTimer.async_wait([&io](const boost::system::error_code &) { io.stop(); });
+
+    std::vector<std::thread> threads;
+    for (unsigned i = 1; i < threadsCount; i++) {
+        threads.emplace_back([&io]() { io.run(); });
+    }
+    io.run();
+    for (auto &thread : threads) {
+        thread.join();
+    }
+
+    u64 received[2] = {0, 0};
+    u64 lost[2] = {0, 0};
+    LatencyDatabase::ProtocolType protocols[2] = {LatencyDatabase::ProtocolType::UDP,
+                                                  LatencyDatabase::ProtocolType::ICMP};
+    for (const auto &entry : lb.getAll()) {
+        for (unsigned i = 0; i < 2; i++) {
+            received[i] += entry.second.getReceivedCount(protocols[i]);
+            lost[i] += entry.second.getLostCount(protocols[i]);
+        }
+    }
+
+    std::cout << "threads " << threadsCount << ", hosts " << hostsCount << ", " << seconds
+              << " s: replies per second UDP " << received[0] / seconds << ", ICMP "
+              << received[1] / seconds << ", total " << (received[0] + received[1]) / seconds
+              << "; lost UDP " << lost[0] << ", ICMP " << lost[1] << std::endl;
+    // reflector threads are blocked in recvmsg
+    _exit(EXIT_SUCCESS);
+}
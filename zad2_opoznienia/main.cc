@@ -1,20 +1,28 @@
 #include <iostream>
 #include <ctime>
 #include <cstdlib>
+#include <cstring>
+#include <pthread.h>
 
 #include <boost/exception/diagnostic_information.hpp>
 
 #include "SDServerClient.h"
 #include "LatencyDatabase.h"
 #include "UDPService.h"
+#include "UDPReflector.h"
 #include "ICMPEchoPacket.h"
 #include "ICMPService.h"
+#include "ProbeScheduler.h"
 #include "TCPService.h"
 #include "TELNETServer.h"
 
 struct Services {
-    Services(boost::asio::io_service &io, LatencyDatabase &lb, u16 udpServerPort)
-        : udp(io, lb, udpServerPort), icmp(io, lb), tcp(io, lb) {
+    Services(boost::asio::io_service &io, LatencyDatabase &lb, u16 udpServerPort,
+             bool kernelTimestamps, bool serveUDPRequests, ICMPService::SocketType icmpSocketType,
+             TCPService::Mode tcpMode, unsigned maxTCPConnects)
+        : udp(io, lb, udpServerPort, kernelTimestamps, serveUDPRequests),
+          icmp(io, lb, kernelTimestamps, icmpSocketType),
+          tcp(io, lb, tcpMode, maxTCPConnects) {
     }
 
     UDPService udp;
@@ -29,10 +37,21 @@ struct RunConfiguration {
     std::chrono::seconds multicastLookupInterval;
     std::chrono::milliseconds telnetInterfaceRefreshInterval;
     bool TCPServiceAvailable;
+    std::chrono::seconds latencyWindow;
+    bool kernelTimestamps;
+    unsigned maxPacketsPerSecond;
+    unsigned ioThreads;
+    unsigned reflectorSockets;
+    bool icmpDatagramSocket;
+    unsigned trainLength;
+    TCPService::Mode tcpMode;
+    unsigned maxTCPConnects;
+    bool pinIOThreads;
 };
 
-void measureLatency(Services &services, LatencyDatabase &lb, std::chrono::seconds loopTime);
 RunConfiguration parseArguments(int argc, char **argv);
+// cpu - processor to pin thread to, -1 if thread is not pinned
+void runIOService(boost::asio::io_service &io, int cpu);
 
 int main(int argc, char **argv) {
     srand((unsigned)time(nullptr));
@@ -49,19 +68,66 @@ int main(int argc, char **argv) {
               << "Czas pomiedzy aktualizacjami interfejsu uzytkownika: "
               << configuration.telnetInterfaceRefreshInterval.count() / 1000.0 << "s" << std::endl
               << "Rozglaszanie dostepu do uslugi _ssh._tcp: " << configuration.TCPServiceAvailable
-              << std::endl;
-
-    LatencyDatabase lb;
-    TELNETServer telnetSrv(configuration.telnetPort, lb);
-    SDServerClient dnsSD(lb);
+              << std::endl
+              << "Okno pomiarow opoznien: " << configuration.latencyWindow.count() << "s"
+              << std::endl
+              << "Znaczniki czasu odbioru z jadra: " << configuration.kernelTimestamps
+              << std::endl
+              << "Limit pakietow pomiarowych na sekunde: " << configuration.maxPacketsPerSecond
+              << std::endl
+              << "Watki obslugujace pomiary, mDNS i TELNET: " << configuration.ioThreads
+              << std::endl
+              << "Gniazda serwera UDP (SO_REUSEPORT): " << configuration.reflectorSockets
+              << std::endl
+              << "ICMP przez gniazdo datagramowe (bez uprawnien): "
+              << configuration.icmpDatagramSocket << std::endl
+              << "Pomiary w serii na komputer: " << configuration.trainLength << std::endl
+              << "RTT TCP z jadra (TCP_INFO): "
+              << (configuration.tcpMode == TCPService::Mode::KERNEL_RTT ||
+                  configuration.tcpMode == TCPService::Mode::KEEP_ALIVE)
+              << std::endl
+              << "Utrzymywanie polaczen TCP: "
+              << (configuration.tcpMode == TCPService::Mode::KEEP_ALIVE) << std::endl
+              << "Polotwarte pomiary TCP (SYN): "
+              << (configuration.tcpMode == TCPService::Mode::SYN) << std::endl
+              << "Limit jednoczesnych polaczen TCP: " << configuration.maxTCPConnects
+              << std::endl
+              << "Przypinanie watkow do procesorow: " << configuration.pinIOThreads << std::endl;
 
+    // all services but reflector share mainIO and its threads
     boost::asio::io_service mainIO;
     boost::asio::io_service::work work(mainIO);
-    Services services(mainIO, lb, configuration.udpPort);
+
+    LatencyDatabase lb(configuration.latencyWindow, configuration.trainLength);
+    TELNETServer telnetSrv(mainIO, configuration.telnetPort, lb);
+    SDServerClient dnsSD(mainIO, lb, configuration.udpPort);
+    UDPReflector reflector(configuration.udpPort, configuration.reflectorSockets);
+
+    Services services(mainIO,
+                      lb,
+                      configuration.udpPort,
+                      configuration.kernelTimestamps,
+                      configuration.reflectorSockets == 0,
+                      configuration.icmpDatagramSocket ? ICMPService::SocketType::DATAGRAM
+                                                       : ICMPService::SocketType::RAW_OR_DATAGRAM,
+                      configuration.tcpMode,
+                      configuration.maxTCPConnects);
+    ProbeScheduler scheduler(mainIO,
+                             lb,
+                             services.udp,
+                             services.icmp,
+                             services.tcp,
+                             configuration.latencyMeasurementInterval,
+                             configuration.maxPacketsPerSecond,
+                             configuration.trainLength);
 
     try {
+        if (configuration.reflectorSockets) {
+            reflector.run();
+        }
         services.udp.startListening();
         services.icmp.startListening();
+        services.tcp.startListening();
         telnetSrv.run(configuration.telnetInterfaceRefreshInterval);
         dnsSD.run(configuration.multicastLookupInterval, configuration.TCPServiceAvailable);
     } catch (...) {
@@ -69,11 +135,35 @@ int main(int argc, char **argv) {
         return EXIT_FAILURE;
     }
 
-    std::thread measureThread(
-        measureLatency, std::ref(services), std::ref(lb), configuration.latencyMeasurementInterval);
+    scheduler.start();
+
+    unsigned cpus = std::max(std::thread::hardware_concurrency(), 1u);
+    auto cpuFor = [&](unsigned thread) {
+        return configuration.pinIOThreads ? (int)(thread % cpus) : -1;
+    };
+    std::vector<std::thread> ioThreads;
+    for (unsigned i = 1; i < configuration.ioThreads; i++) {
+        ioThreads.emplace_back(runIOService, std::ref(mainIO), cpuFor(i));
+    }
+    runIOService(mainIO, cpuFor(0));
+    for (auto &thread : ioThreads) {
+        thread.join();
+    }
+}
+
+void runIOService(boost::asio::io_service &io, int cpu) {
+    if (cpu >= 0) {
+        cpu_set_t cpuSet;
+        CPU_ZERO(&cpuSet);
+        CPU_SET(cpu, &cpuSet);
+        int error = pthread_setaffinity_np(pthread_self(), sizeof(cpuSet), &cpuSet);
+        if (error) {
+            std::cerr << __func__ << ": " << strerror(error) << "\n";
+        }
+    }
 
     try {
-        mainIO.run();
+        io.run();
     } catch (std::exception &e) {
         std::cerr << __func__ << ": " << e.what() << std::endl;
     } catch (...) {
@@ -82,32 +172,11 @@ int main(int argc, char **argv) {
     }
 }
 
-void measureLatency(Services &services, LatencyDatabase &lb, std::chrono::seconds loopTime) {
-    while (true) {
-        auto hosts = lb.getAll();
-        std::vector<boost::asio::ip::address_v4> tcpAddrs;
-        std::vector<boost::asio::ip::address_v4> udpAddrs;
-        for (auto x : hosts) {
-            if (x.second.isProtocolAvailable(LatencyDatabase::ProtocolType::TCP)) {
-                tcpAddrs.push_back(x.first);
-            }
-            if (x.second.isProtocolAvailable(LatencyDatabase::ProtocolType::UDP)) {
-                udpAddrs.push_back(x.first);
-            }
-        }
-
-        services.udp.measureLatency(udpAddrs);
-        services.icmp.measureLatency(udpAddrs);
-        services.tcp.measureLatency(tcpAddrs);
-
-        std::this_thread::sleep_for(loopTime);
-    }
-}
-
 bool isUnsignedInteger(const char *str);
 bool isUnsignedDouble(const char *str);
 u16 parseToPort(const char *str);
 std::chrono::seconds parseToSeconds(const char *str);
+unsigned parseToUnsigned(const char *str);
 std::chrono::milliseconds parseSecondsInDouble(const char *str);
 
 // port serwera do pomiaru opóźnień przez UDP: 3382 (-u)
@@ -116,16 +185,47 @@ std::chrono::milliseconds parseSecondsInDouble(const char *str);
 // czas pomiędzy wykrywaniem komputerów: 10 sekund (-T)
 // czas pomiędzy aktualizacjami interfejsu użytkownika: 1 sekunda (-v)
 // rozgłaszanie dostępu do usługi _ssh._tcp: domyślnie wyłączone (-s)
+// okno, z którego liczone są percentyle opóźnień: 10 sekund (-w)
+// znaczniki czasu odbioru z jądra (SO_TIMESTAMPING): domyślnie wyłączone (-k)
+// limit pakietów pomiarowych na sekundę: domyślnie brak (-p 0)
+// liczba wątków obsługujących pomiary, mDNS i TELNET: 1 (-j)
+// liczba gniazd serwera UDP z własnymi wątkami (SO_REUSEPORT): domyślnie 0,
+// czyli jedno gniazdo obsługiwane razem z pomiarami (-r)
+// ICMP tylko przez gniazdo datagramowe (ping socket), domyślnie surowe gniazdo,
+// a datagramowe, gdy brak uprawnień (-i)
+// liczba pomiarów w serii wysyłanej do komputera, co 10 ms: 1 (-K), najwyżej 16
+// RTT TCP odczytywane z jądra (TCP_INFO): domyślnie wyłączone (-R)
+// utrzymywanie połączeń TCP i odczyty RTT z jądra, gdy jądro ma nową próbkę,
+// a bez niej ponowne nawiązanie połączenia: domyślnie wyłączone (-A)
+// limit jednoczesnych połączeń TCP, pozostałe czekają w kolejce: 256 (-c), 0 - brak
+// półotwarte pomiary TCP przez surowe gniazdo (SYN), bez połączeń: domyślnie wyłączone (-S)
+// przypinanie kolejnych wątków z -j do kolejnych procesorów: domyślnie wyłączone (-a)
 RunConfiguration parseArguments(int argc, char **argv) {
-    RunConfiguration res{3382, 3637, std::chrono::seconds(1), std::chrono::seconds(10),
-                         std::chrono::seconds(1), false};
+    RunConfiguration res{3382,
+                         3637,
+                         std::chrono::seconds(1),
+                         std::chrono::seconds(10),
+                         std::chrono::seconds(1),
+                         false,
+                         std::chrono::seconds(10),
+                         false,
+                         0,
+                         1,
+                         0,
+                         false,
+                         1,
+                         TCPService::Mode::CONNECT,
+                         256,
+                         false};
+
+    static const char *options = "u:: U:: t:: T:: v:: s w:: k p:: j:: r:: i K:: R A c:: S a";
 
     opterr = 0;
     bool ok = true;
     int arg;
 
     try {
-        while (ok && (arg = getopt(argc, argv, "u:: U:: t:: T:: v:: s")) != -1) {
+        while (ok && (arg = getopt(argc, argv, options)) != -1) {
             switch (arg) {
                 case 'u':
                     res.udpPort = parseToPort(optarg);
@@ -145,6 +245,49 @@ RunConfiguration parseArguments(int argc, char **argv) {
                 case 's':
                     res.TCPServiceAvailable = true;
                     break;
+                case 'w':
+                    res.latencyWindow = parseToSeconds(optarg);
+                    break;
+                case 'k':
+                    res.kernelTimestamps = true;
+                    break;
+                case 'p':
+                    res.maxPacketsPerSecond = parseToUnsigned(optarg);
+                    break;
+                case 'j':
+                    res.ioThreads = std::max(parseToUnsigned(optarg), 1u);
+                    break;
+                case 'r':
+                    res.reflectorSockets = parseToUnsigned(optarg);
+                    break;
+                case 'i':
+                    res.icmpDatagramSocket = true;
+                    break;
+                case 'K':
+                    res.trainLength = parseToUnsigned(optarg);
+                    if (res.trainLength < 1 || res.trainLength > MAX_TRAIN_LENGTH) {
+                        throw UnknownFormatException();
+                    }
+                    break;
+                case 'R':
+                    if (res.tcpMode == TCPService::Mode::CONNECT) {
+                        res.tcpMode = TCPService::Mode::KERNEL_RTT;
+                    }
+                    break;
+                case 'A':
+                    if (res.tcpMode != TCPService::Mode::SYN) {
+                        res.tcpMode = TCPService::Mode::KEEP_ALIVE;
+                    }
+                    break;
+                case 'S':
+                    res.tcpMode = TCPService::Mode::SYN;
+                    break;
+                case 'c':
+                    res.maxTCPConnects = parseToUnsigned(optarg);
+                    break;
+                case 'a':
+                    res.pinIOThreads = true;
+                    break;
                 default:
                     throw UnknownFormatException();
             }
@@ -153,7 +296,9 @@ RunConfiguration parseArguments(int argc, char **argv) {
             throw UnknownFormatException();
         }
     } catch (UnknownFormatException &) {
-        std::cout << "Usage: %s [-u port] [-U port] [-t time] [-T time] [-v time] [-s]"
+        std::cout << "Usage: %s [-u port] [-U port] [-t time] [-T time] [-v time] [-s] [-w time]"
+                     " [-k] [-p count] [-j threads] [-r sockets] [-i]"
+                     " [-K count] [-R] [-A] [-c count] [-S] [-a]"
                   << std::endl;
         exit(EXIT_SUCCESS);
     }
@@ -174,6 +319,13 @@ std::chrono::seconds parseToSeconds(const char *str) {
     throw UnknownFormatException();
 }
 
+unsigned parseToUnsigned(const char *str) {
+    if (str && isUnsignedInteger(str)) {
+        return std::strtoul(str, nullptr, 10);
+    }
+    throw UnknownFormatException();
+}
+
 std::chrono::milliseconds parseSecondsInDouble(const char *str) {
     if (str && isUnsignedDouble(str)) {
         return std::chrono::milliseconds(std::lround(std::atof(str) * 1000.0));
@@ -5,5 +5,16 @@
 #define SMALL_BUFFER_SIZE 64
 #define TCP_PORT 22
 #define MAX_LATENCY_SECS 11
+// probes sent/received in one sendmmsg/recvmmsg call
+#define UDP_BATCH_SIZE 64
+// at most 2^PENDING_PROBES_BITS probes of one kind wait for response
+#define PENDING_PROBES_BITS 16
+// longest train of probes sent to one host in one round
+#define MAX_TRAIN_LENGTH 16
+// at most MAX_INSTANCES_PER_HOST UDP services of one host are probed,
+// e.g. instances listening on several ports
+#define MAX_INSTANCES_PER_HOST 4
+// at most 2^KNOWN_HOSTS_BITS hosts advertising services are remembered
+#define KNOWN_HOSTS_BITS 15
 
 #endif
\ No newline at end of file
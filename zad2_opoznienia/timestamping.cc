@@ -0,0 +1,38 @@
+#include <algorithm>
+#include <linux/net_tstamp.h>
+
+#include "timestamping.h"
+
+namespace timestamping {
+
+bool enable(int socket) {
+    // hardware timestamps are taken from NIC clock, which can't be compared with send times
+    // read from system clock, so only software ones are requested
+    int flags = SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE;
+    return setsockopt(socket, SOL_SOCKET, SO_TIMESTAMPING, &flags, sizeof(flags)) == 0;
+}
+
+bool getReceiveTime(msghdr *msg, std::chrono::steady_clock::time_point &receiveTime) {
+    for (cmsghdr *cmsg = CMSG_FIRSTHDR(msg); cmsg; cmsg = CMSG_NXTHDR(msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPING) {
+            // [0] - software, [1] - deprecated, [2] - raw hardware
+            const timespec *stamps = (const timespec *)CMSG_DATA(cmsg);
+            auto stamp = std::chrono::system_clock::time_point(
+                std::chrono::duration_cast<std::chrono::system_clock::duration>(
+                    std::chrono::seconds(stamps[0].tv_sec) +
+                    std::chrono::nanoseconds(stamps[0].tv_nsec)));
+
+            // only time spent in queue is taken from system clock,
+            // so clock step between receiving and reading doesn't matter much
+            auto queueTime = std::max(std::chrono::system_clock::now() - stamp,
+                                      std::chrono::system_clock::duration(0));
+            receiveTime =
+                std::chrono::steady_clock::now() -
+                std::chrono::duration_cast<std::chrono::steady_clock::duration>(queueTime);
+            return true;
+        }
+    }
+    return false;
+}
+
+}  // timestamping
@@ -0,0 +1,24 @@
+#ifndef TIMESTAMPING__H
+#define TIMESTAMPING__H
+
+#include <sys/socket.h>
+#include <chrono>
+#include <ctime>
+
+#include "bitops.h"
+
+// kernel receive timestamps (SO_TIMESTAMPING)
+namespace timestamping {
+// enough for SCM_TIMESTAMPING (3 timespecs) and IP_PKTINFO
+constexpr std::size_t CONTROL_BUFFER_SIZE = 256;
+
+// requests software receive timestamps on socket
+// returns false if not supported
+bool enable(int socket);
+
+// receive time of message moved from system clock (used by kernel) to steady clock
+// returns false if message doesn't carry timestamp
+bool getReceiveTime(msghdr *msg, std::chrono::steady_clock::time_point &receiveTime);
+}
+
+#endif